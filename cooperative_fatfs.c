@@ -1,13 +1,23 @@
 #include "cooperative_fatfs.h"
+#include "diskio.h"
 #include "RP2350.h"
 
 #include "hardware/gpio.h"
+#include "hardware/timer.h"
+#include "hardware/irq.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 /* need to be able to tell fatfs internals that it will have to reinit the card */
-extern unsigned char diskio_initted;
+extern void disk_release(void);
+
+/* lets the diskio layer close things it has left open for too long */
+extern void disk_service(void);
+
+/* lets the diskio layer know which sectors hold filesystem metadata */
+extern void disk_learn_layout(const FATFS * fs);
 
 extern void yield(void);
 extern void lower_power_sleep_ms(unsigned);
@@ -18,9 +28,60 @@ __attribute((weak)) void enable_line_release(void) { }
 
 __attribute((aligned(4))) FATFS * fs = &(static FATFS) { };
 
+/* if nonzero, the mounted state in fs is kept when the card is powered off, and reused when
+ it is powered on again if the card and the start of the volume are unchanged */
+unsigned char fast_remount = 1;
+static unsigned char retained = 0;
+static unsigned char retained_cid[16];
+static uint32_t retained_hash;
+
+size_t mounts_fast = 0, mounts_full = 0;
+unsigned long mount_fast_us_last = 0, mount_full_us_last = 0;
+
+/* fnv-1a of the volume boot sector, which includes the volume serial number, and of the
+ fsinfo sector on fat32, read through fs->win just as fatfs itself would */
+static int volume_hash(uint32_t * hash) {
+    const LBA_t sectors[2] = { fs->volbase, fs->volbase + 1 };
+    *hash = 2166136261U;
+
+    for (size_t isector = 0; isector < (FS_FAT32 == fs->fs_type ? 2U : 1U); isector++) {
+        if (disk_read(fs->pdrv, fs->win, sectors[isector], 1)) {
+            fs->winsect = (LBA_t)0 - 1;
+            return -1;
+        }
+        fs->winsect = sectors[isector];
+
+        for (size_t ibyte = 0; ibyte < 512; ibyte++)
+            *hash = (*hash ^ fs->win[ibyte]) * 16777619U;
+    }
+
+    return 0;
+}
+
+/* with the card freshly powered up, whether what fs says about it can still be trusted */
+static int remount_fast(void) {
+    if (disk_initialize(fs->pdrv) & STA_NOINIT) return -1;
+    if (memcmp(sd_card_info.cid, retained_cid, sizeof(retained_cid))) return -1;
+
+    uint32_t hash;
+    if (-1 == volume_hash(&hash) || hash != retained_hash) return -1;
+
+    return 0;
+}
+
 static volatile unsigned char card_locked = 0;
 volatile char card_users = 0;
 
+/* the card stays powered and mounted for this long after the last user releases it, so that
+ a burst of short uses only pays for one power-up and mount */
+unsigned long card_linger_ms = 500;
+static unsigned char lingering = 0;
+static unsigned long linger_timerawl;
+static int linger_alarm = -1;
+
+size_t card_remounts_avoided = 0, card_linger_expiries = 0;
+unsigned long long card_lingered_us = 0;
+
 void card_lock(void) {
     while (card_locked) yield();
     card_locked = 1;
@@ -31,29 +92,92 @@ void card_unlock(void) {
     __SEV();
 }
 
+static void linger_alarm_unclaim(void) {
+    if (-1 == linger_alarm) return;
+    hw_clear_bits(&timer_hw->inte, 1U << linger_alarm);
+    hw_clear_bits(&timer_hw->intr, 1U << linger_alarm);
+    irq_clear(hardware_alarm_get_irq_num(linger_alarm));
+    timer_hardware_alarm_unclaim(timer_hw, linger_alarm);
+    linger_alarm = -1;
+}
+
+static void linger_end(void) {
+    lingering = 0;
+    card_lingered_us += timer_hw->timerawl - linger_timerawl;
+    linger_alarm_unclaim();
+}
+
+/* with the lock held and no users left */
+static void card_power_down(void) {
+    /* make sure nothing is left open or deferred in the diskio layer */
+    disk_ioctl(0, CTRL_SYNC, NULL);
+
+    /* remember enough about the card and volume to know whether the next mount can be
+     skipped. not if fatfs still has a dirty sector of its own, which is about to be lost */
+    retained = fast_remount && fs->fs_type && !fs->wflag && -1 != volume_hash(&retained_hash);
+    if (retained) memcpy(retained_cid, sd_card_info.cid, sizeof(retained_cid));
+
+    /* fatfs doesn't give us any API to have it tell the lower level diskio code that
+     the card has been power cycled and will have to be initted when mounting again,
+     and nothing should be held by the block device code while the card is unpowered */
+    disk_release();
+
+    enable_line_release();
+}
+
 int card_request(void) {
     card_lock();
 
+    /* still powered and mounted from a recent use */
+    if (!card_users && lingering) {
+        linger_end();
+        card_remounts_avoided++;
+        card_users++;
+        return 0;
+    }
+
     if (!(card_users++)) {
-        /* enable power to card */
+        /* enable power to card, and start timing each stage of getting it ready */
+        sd_startup_begin();
         enable_line_request();
+        sd_startup_mark(SD_STARTUP_POWERED);
 
         /* we have a guarantee that when the above returns, it has been at least 1 ms since
          power was applied to the sd card */
 
-        dprintf(2, "%s: mounting\r\n", __func__);
-
-        FRESULT fres;
-        if ((fres = f_mount(fs, "", 1))) {
-            card_users--;
-            enable_line_release();
-            card_unlock();
-            if (FR_NOT_READY == fres)
-                dprintf(2, "error: %s: card apparently not present\r\n", __func__);
-            else
-                dprintf(2, "error: %s: f_mount(): %d\r\n", __func__, fres);
-            return -1;
+        const unsigned long mount_timerawl = timer_hw->timerawl;
+
+        if (retained && -1 != remount_fast()) {
+            dprintf(2, "%s: reusing previous mount\r\n", __func__);
+            mounts_fast++;
+            mount_fast_us_last = timer_hw->timerawl - mount_timerawl;
+        } else {
+            dprintf(2, "%s: mounting\r\n", __func__);
+
+            FRESULT fres;
+            if ((fres = f_mount(fs, "", 1))) {
+                retained = 0;
+                card_users--;
+
+                /* f_mount may have gotten as far as leaving a read open in the diskio layer,
+                 which must be closed, and everything given back, before power goes away */
+                if (!(disk_status(0) & STA_NOINIT)) disk_ioctl(0, CTRL_SYNC, NULL);
+                disk_release();
+                enable_line_release();
+                card_unlock();
+                if (FR_NOT_READY == fres)
+                    dprintf(2, "error: %s: card apparently not present\r\n", __func__);
+                else
+                    dprintf(2, "error: %s: f_mount(): %d\r\n", __func__, fres);
+                return -1;
+            }
+            mounts_full++;
+            mount_full_us_last = timer_hw->timerawl - mount_timerawl;
         }
+        retained = 0;
+
+        sd_startup_mark(SD_STARTUP_MOUNT);
+        disk_learn_layout(fs);
     }
 
     /* caller holds the lock when this returns successfully */
@@ -63,11 +187,37 @@ int card_request(void) {
 void card_release(void) {
     /* caller is expected to still hold the lock */
     if (!(--card_users)) {
-        /* fatfs doesn't give us any API to have it tell the lower level diskio code that
-         the card has been power cycled and will have to be initted when mounting again */
-        diskio_initted = 0;
+        if (!card_linger_ms) card_power_down();
+        else {
+            /* nothing is left dirty while lingering, in case power goes away meanwhile */
+            disk_ioctl(0, CTRL_SYNC, NULL);
+
+            /* get a timer whose interrupt will wake the processor via sevonpend, but leave
+             it disabled in nvic, so that card_service() gets a chance to power down */
+            linger_alarm = timer_hardware_alarm_claim_unused(timer_hw, true);
+            hw_set_bits(&timer_hw->inte, 1U << linger_alarm);
+            irq_set_enabled(hardware_alarm_get_irq_num(linger_alarm), false);
+
+            lingering = 1;
+            linger_timerawl = timer_hw->timerawl;
+            timer_hw->alarm[linger_alarm] = linger_timerawl + card_linger_ms * 1000;
+        }
+    }
+
+    card_unlock();
+}
+
+void card_service(void) {
+    /* never waits for the lock, and does nothing if the card is not in use */
+    if (card_locked || (!card_users && !lingering)) return;
+
+    card_lock();
+    disk_service();
 
-        enable_line_release();
+    if (lingering && timer_hw->timerawl - linger_timerawl >= card_linger_ms * 1000) {
+        linger_end();
+        card_linger_expiries++;
+        card_power_down();
     }
 
     card_unlock();
@@ -6,6 +6,8 @@ void card_release(void);
 void card_lock(void);
 void card_unlock(void);
 
+void card_service(void);
+
 int ls(const char * path);
 int cat(const char * path);
 
@@ -13,4 +15,10 @@ int cat(const char * path);
 #include "ff.h"
 
 extern volatile char card_users;
+extern unsigned char fast_remount;
+extern size_t mounts_fast, mounts_full;
+extern unsigned long mount_fast_us_last, mount_full_us_last;
+extern unsigned long card_linger_ms;
+extern size_t card_remounts_avoided, card_linger_expiries;
+extern unsigned long long card_lingered_us;
 extern FATFS * fs;
@@ -0,0 +1,174 @@
+/* stackful round robin cooperative tasks behind yield() and current_task(), which override the
+ weak versions elsewhere. on the rp2350 each task has its own stack and stack limit, and
+ switching saves only the callee-saved registers. elsewhere, ucontext is used instead, so
+ that code built on top of this can be run and timed on a host */
+#include "cooperative_tasks.h"
+
+#include <stdint.h>
+
+#if defined(__arm__)
+#include "hardware/sync.h"
+#include "RP2350.h"
+#else
+#include <ucontext.h>
+#endif
+
+size_t task_switches = 0, task_passes = 0;
+
+static struct task {
+    void (* func)(void *);
+    void * arg;
+    unsigned char running;
+#if defined(__arm__)
+    void * sp;
+    uint32_t stack_limit;
+#else
+    ucontext_t context;
+#endif
+} tasks[TASKS_MAX] = { [0] = { .running = 1 } };
+
+/* the task that called main() is always in slot 0 and never exits */
+static size_t task_current = 0;
+
+#if defined(__arm__)
+#if defined(__ARM_FP)
+#define FP_WORDS 16
+#define FP_PUSH "vpush {s16-s31}\n"
+#define FP_POP "vpop {s16-s31}\n"
+#else
+#define FP_WORDS 0
+#define FP_PUSH
+#define FP_POP
+#endif
+
+/* pushes the callee-saved registers and stores the resulting stack pointer in *sp_from, then
+ moves to sp_to, whose stack limit is limit_to, and pops whatever was pushed there. the limit
+ is cleared in between, since task stacks are not above the main one */
+extern void task_context_switch(void ** sp_from, void * sp_to, uint32_t limit_to);
+__asm(
+    ".syntax unified\n"
+    ".thumb\n"
+    ".text\n"
+    ".align 2\n"
+    ".global task_context_switch\n"
+    ".type task_context_switch, %function\n"
+    ".thumb_func\n"
+    "task_context_switch:\n"
+    "push {r4-r11, lr}\n"
+    FP_PUSH
+    "mov r3, sp\n"
+    "str r3, [r0]\n"
+    "movs r3, #0\n"
+    "msr msplim, r3\n"
+    "mov sp, r1\n"
+    "msr msplim, r2\n"
+    FP_POP
+    "pop {r4-r11, pc}\n"
+    ".size task_context_switch, . - task_context_switch\n"
+);
+#endif
+
+static void sleep_until_event(void) {
+#if defined(__arm__)
+    __DSB(); __WFE();
+#endif
+}
+
+static void task_switch_to(const size_t next) {
+    struct task * from = tasks + task_current, * to = tasks + next;
+    task_current = next;
+    task_switches++;
+
+#if defined(__arm__)
+    from->stack_limit = __get_MSPLIM();
+    task_context_switch(&from->sp, to->sp, to->stack_limit);
+#else
+    swapcontext(&from->context, &to->context);
+#endif
+}
+
+void yield(void) {
+#if defined(__arm__)
+    /* core1 has no tasks of its own, and only ever waits for events */
+    if (get_core_num()) {
+        __DSB(); __WFE();
+        return;
+    }
+#endif
+
+    size_t next = task_current;
+    do next = (next + 1) % TASKS_MAX; while (!tasks[next].running);
+
+    /* once per pass over all tasks, sleep until something happens. anything that changes a
+     condition another task may be waiting on, outside of an interrupt, must __SEV() */
+    if (next <= task_current) {
+        task_passes++;
+        sleep_until_event();
+    }
+
+    if (next != task_current) task_switch_to(next);
+}
+
+void * current_task(void) {
+#if defined(__arm__)
+    if (get_core_num()) return NULL;
+#endif
+    return tasks + task_current;
+}
+
+void task_exit(void) {
+    tasks[task_current].running = 0;
+
+    /* tasks waiting for this one to finish get a chance to see that it has */
+#if defined(__arm__)
+    __SEV();
+#endif
+
+    /* this task is no longer in the rotation, so this never comes back */
+    yield();
+    __builtin_unreachable();
+}
+
+static void task_entry(void) {
+    struct task * task = tasks + task_current;
+    task->func(task->arg);
+    task_exit();
+}
+
+#if !defined(__arm__)
+/* kept apart from task_create() so that getcontext() returning twice cannot clobber its locals */
+static void context_init(ucontext_t * context, void * stack, const size_t stack_size) {
+    getcontext(context);
+    context->uc_stack.ss_sp = stack;
+    context->uc_stack.ss_size = stack_size;
+    context->uc_link = NULL;
+    makecontext(context, task_entry, 0);
+}
+#endif
+
+void * task_create(void (* func)(void *), void * arg, void * stack, size_t stack_size) {
+    size_t itask;
+    for (itask = 1; itask < TASKS_MAX && tasks[itask].running; itask++);
+    if (TASKS_MAX == itask) return NULL;
+
+    struct task * task = tasks + itask;
+    task->func = func;
+    task->arg = arg;
+
+#if defined(__arm__)
+    /* a frame for the first switch to this task to pop, leaving the stack aligned as if
+     task_entry had been called normally, and returning into it */
+    uint32_t * top = (uint32_t *)(((uintptr_t)stack + stack_size) & ~(uintptr_t)7);
+    uint32_t * sp = top - (FP_WORDS + 9);
+    for (size_t iword = 0; iword < FP_WORDS + 9; iword++) sp[iword] = 0;
+    sp[FP_WORDS + 8] = (uint32_t)(uintptr_t)task_entry;
+
+    task->sp = sp;
+    task->stack_limit = ((uintptr_t)stack + 7) & ~(uintptr_t)7;
+#else
+    context_init(&task->context, stack, stack_size);
+#endif
+
+    task->running = 1;
+    return task;
+}
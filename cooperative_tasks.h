@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+
+/* maximum number of tasks, including the one that called main() */
+#ifndef TASKS_MAX
+#define TASKS_MAX 4
+#endif
+
+/* starts func(arg) in a new task on the given stack, which must stay valid until the task
+ exits. the new task first runs when the caller next yields. returns NULL if no slot is free */
+void * task_create(void (* func)(void *), void * arg, void * stack, size_t stack_size);
+
+/* ends the calling task, which also happens when its function returns. main() must not */
+__attribute((noreturn)) void task_exit(void);
+
+/* runs the next task, and sleeps until an event once per pass over all of them */
+void yield(void);
+
+/* unique to each task on core0, and NULL on core1, which does not run tasks */
+void * current_task(void);
+
+extern size_t task_switches, task_passes;
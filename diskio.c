@@ -7,7 +7,25 @@
 /* block device implementation code being wrapped by this */
 #include "rp2350_sdcard.h"
 
-/* needed for INT_MAX, this will go away */
+/* if everything here runs on core1, the functions of these names that the rest of the code
+ calls on core0 are in rp2350_storage_core.c, and forward each call to these */
+#include "rp2350_storage_core.h"
+#if STORAGE_ON_CORE1
+#define disk_status core1_disk_status
+#define disk_initialize core1_disk_initialize
+#define disk_read core1_disk_read
+#define disk_write core1_disk_write
+#define disk_ioctl core1_disk_ioctl
+#define disk_service core1_disk_service
+#define disk_learn_layout core1_disk_learn_layout
+#define disk_release core1_disk_release
+#endif
+
+/* for timestamps and the alarm used to close idle sessions and flush old dirty sectors */
+#include "hardware/timer.h"
+#include "hardware/irq.h"
+
+/* needed for ULONG_MAX and UINT_MAX */
 #include <limits.h>
 
 #include <stdio.h>
@@ -23,161 +41,1105 @@ DSTATUS disk_status(BYTE pdrv) {
     return diskio_initted ? 0 : STA_NOINIT;
 }
 
-static LBA_t block_cache_sectors[64];
-static unsigned char block_cache[64][512];
-static const size_t B = sizeof(block_cache) / sizeof(block_cache[0]);
-static size_t icache = 0;
+/* sector cache, with CACHE_SETS sets of CACHE_WAYS ways each, indexed by a hash of the
+ sector number, with clock replacement within each set. transfers longer than
+ CACHE_BYPASS_SECTORS are not inserted, so that bulk data flows past without evicting the
+ fat and directory sectors that fatfs rereads constantly, although any sector they touch
+ that is already cached is kept coherent */
+#define CACHE_SETS 16
+#define CACHE_WAYS 4
+#define CACHE_BYPASS_SECTORS 2
 
-DSTATUS disk_initialize(BYTE pdrv) {
-    (void)pdrv;
-    if (!diskio_initted) {
-        for (size_t ipass = 0;; ipass++) {
-            if (ipass > 0 && verbose >= 1)
-                dprintf(2, "%s: retrying at lower baud rate %u\r\n", __func__, (unsigned)ipass + 1);
-            if (spi_sd_init(ipass) != -1) break;
-            if (ipass > 3) return STA_NOINIT;
+/* once the volume layout is known, the first CACHE_PINNED_WAYS ways of every set are only
+ used for fat, root directory, and allocation bitmap sectors, so that bulk data can only
+ ever evict other data, and cluster chain walks keep hitting the cache */
+#define CACHE_PINNED_WAYS 2
+
+static struct cache_tag {
+    LBA_t sector;
+    unsigned char valid;
+    unsigned char referenced;
+    unsigned char dirty;
+} cache_tags[CACHE_SETS * CACHE_WAYS];
+
+__attribute((aligned(4))) static unsigned char cache_data[CACHE_SETS * CACHE_WAYS][512];
+static unsigned char cache_hands[CACHE_SETS];
+
+size_t cache_hits = 0, cache_misses = 0, cache_evictions = 0;
+
+static struct sector_range {
+    LBA_t start, count;
+} metadata_ranges[3];
+static size_t metadata_range_count = 0;
+
+/* if nonzero, short writes only go into the cache, and reach the card in one sorted pass
+ on sync, when a set is full of dirty sectors, when more than cache_dirty_max sectors are
+ dirty, or when the oldest dirty sector is older than cache_dirty_max_age_us. the latter
+ two bound how much data, and how much time, would be lost to a power failure */
+unsigned char cache_write_back = 0;
+size_t cache_dirty_max = 16;
+unsigned long cache_dirty_max_age_us = 1000000;
+size_t cache_flushes = 0;
+
+static size_t cache_dirty_count = 0;
+static unsigned long cache_dirty_oldest_timerawl;
+
+/* a multi-block read or write is left open after each disk_read or disk_write, so that a
+ subsequent call continuing at the next sector in the same direction can keep streaming
+ blocks into or out of it. it is closed when any other access occurs, on sync, or after
+ this long without activity. zero means close it after every call */
+unsigned long session_idle_us = 250000;
+size_t write_sessions_started = 0, read_sessions_started = 0;
+
+/* once no session is open, the block device code keeps its peripheral, clocks, and dma
+ channels for this long after its last use, so that a burst of short transfers does not pay
+ to set them up and tear them down every time, and then gives them back */
+unsigned long driver_hold_us = 20000;
+
+enum { SESSION_NONE, SESSION_WRITE, SESSION_READ };
+static unsigned char session_open = SESSION_NONE;
+static LBA_t session_next_sector;
+static unsigned long session_timerawl;
+static int service_alarm = -1;
+
+/* if nonzero and the allocation unit size is known, no multi-block write crosses an au
+ boundary, and any that begins with at least PRE_ERASE_MIN_SECTORS is announced to the card
+ with acmd23, so that it can prepare that many blocks ahead of time rather than stalling
+ partway through. the busy time within each multi-block write is accumulated, so that the
+ effect on tail latency can be measured */
+#define PRE_ERASE_MIN_SECTORS 8
+
+unsigned char au_staging = 1;
+
+/* sectors that earlier disk_write() calls reported as written, but which the card later said
+ it never programmed, by which time the data is gone. the next sync fails, so that the loss
+ reaches whoever is syncing, rather than only being logged */
+size_t sectors_lost = 0;
+static unsigned char sectors_lost_unreported = 0;
+unsigned long write_session_busy_us_total = 0, write_session_busy_us_max = 0;
+size_t write_sessions_pre_erased = 0;
+
+/* accumulated by the block device code */
+extern unsigned long microseconds_in_wait;
+static unsigned long session_microseconds_in_wait_prior;
+
+/* these can be overridden to run the clocks faster while there is a lot of data to move.
+ neither is called with a transfer open, and the block device code must be told about any
+ change in clocks before either returns */
+__attribute((weak)) void clock_boost_request(void) { }
+__attribute((weak)) void clock_boost_release(void) { }
+
+/* faster clocks are requested once a run of consecutive sectors in the same direction
+ reaches CLOCK_BOOST_MIN_SECTORS, and released once nothing has been transferred, and
+ nothing is left open or dirty, for clock_boost_hold_us */
+#define CLOCK_BOOST_MIN_SECTORS 64
+unsigned long clock_boost_hold_us = 100000;
+
+static unsigned char clock_boosted = 0, streak_direction = SESSION_NONE;
+static LBA_t streak_next_sector, streak_sectors = 0;
+
+/* arms an alarm for whichever of the idle session, the idle driver, or the oldest dirty
+ sector is due first */
+static void service_alarm_rearm(void) {
+    const unsigned long now = timer_hw->timerawl;
+    unsigned long remaining = ULONG_MAX;
+
+    if (session_open) {
+        const unsigned long elapsed = now - session_timerawl;
+        remaining = elapsed < session_idle_us ? session_idle_us - elapsed : 0;
+    }
+
+    if (spi_sd_session_held()) {
+        const unsigned long elapsed = spi_sd_session_idle_us();
+        const unsigned long driver_remaining = elapsed < driver_hold_us ? driver_hold_us - elapsed : 0;
+        if (driver_remaining < remaining) remaining = driver_remaining;
+    }
+
+    if (clock_boosted) {
+        const unsigned long elapsed = now - session_timerawl;
+        const unsigned long boost_remaining = elapsed < clock_boost_hold_us ? clock_boost_hold_us - elapsed : 0;
+        if (boost_remaining < remaining) remaining = boost_remaining;
+    }
+
+    if (cache_dirty_count) {
+        const unsigned long elapsed = now - cache_dirty_oldest_timerawl;
+        const unsigned long dirty_remaining = elapsed < cache_dirty_max_age_us ? cache_dirty_max_age_us - elapsed : 0;
+        if (dirty_remaining < remaining) remaining = dirty_remaining;
+    }
+
+    if (ULONG_MAX == remaining) return;
+
+    /* get a timer whose interrupt will wake the processor via sevonpend, but leave it
+     disabled in nvic, so that disk_service() gets a chance to do whatever is due */
+    if (-1 == service_alarm) {
+        service_alarm = timer_hardware_alarm_claim_unused(timer_hw, true);
+        hw_set_bits(&timer_hw->inte, 1U << service_alarm);
+        irq_set_enabled(hardware_alarm_get_irq_num(service_alarm), false);
+    }
+
+    hw_clear_bits(&timer_hw->intr, 1U << service_alarm);
+    irq_clear(hardware_alarm_get_irq_num(service_alarm));
+    timer_hw->alarm[service_alarm] = now + (remaining ? remaining : 1);
+}
+
+static void session_close(void) {
+    const unsigned char was_open = session_open;
+    session_open = SESSION_NONE;
+
+    if (SESSION_WRITE == was_open) {
+        spi_sd_write_blocks_end();
+
+        const unsigned long busy_us = microseconds_in_wait - session_microseconds_in_wait_prior;
+        write_session_busy_us_total += busy_us;
+        if (busy_us > write_session_busy_us_max) write_session_busy_us_max = busy_us;
+    }
+    else if (SESSION_READ == was_open)
+        spi_sd_read_blocks_end();
+
+    /* the block device code is now idle, so start counting toward giving it back */
+    if (was_open) service_alarm_rearm();
+}
+
+/* closes whatever is open unless it can be continued at the given sector */
+static void session_continue_or_close(const unsigned char direction, LBA_t sector) {
+    if (session_open && (session_open != direction || sector != session_next_sector))
+        session_close();
+}
+
+static void session_advance(LBA_t next_sector) {
+    session_next_sector = next_sector;
+    session_timerawl = timer_hw->timerawl;
+
+    if (!session_idle_us) {
+        session_close();
+        return;
+    }
+
+    service_alarm_rearm();
+}
+
+static int session_write_within_au(const BYTE * buff, LBA_t sector, UINT count, const unsigned long au) {
+    session_continue_or_close(SESSION_WRITE, sector);
+
+    /* start a new multi-block write at every au boundary */
+    if (session_open && au && !(sector % au))
+        session_close();
+
+    if (!session_open) {
+        /* failure here is not fatal, the card just does not get the hint */
+        if (au_staging && count >= PRE_ERASE_MIN_SECTORS && -1 != spi_sd_write_pre_erase(count))
+            write_sessions_pre_erased++;
+
+        if (-1 == spi_sd_write_blocks_start(sector)) return -1;
+        session_open = SESSION_WRITE;
+        session_microseconds_in_wait_prior = microseconds_in_wait;
+        write_sessions_started++;
+    }
+
+    /* on failure this has already deselected the card and disabled the peripheral */
+    if (-1 == spi_sd_write_some_blocks(buff, count)) {
+        session_open = SESSION_NONE;
+
+        const unsigned long lost = spi_sd_blocks_lost();
+        if (lost) {
+            sectors_lost += lost;
+            sectors_lost_unreported = 1;
         }
-        spi_sd_restore_baud_rate();
+        return -1;
     }
+    sd_startup_mark(SD_STARTUP_FIRST_WRITE);
+
+    session_advance(sector + count);
+    return 0;
+}
 
-    __builtin_memset(block_cache_sectors, 0, sizeof(block_cache_sectors));
+/* on failure, done is set to however many of the blocks the card confirmed */
+static int card_session_write(const BYTE * buff, LBA_t sector, UINT count, UINT * done) {
+    const unsigned long au = au_staging ? sd_card_info.au_blocks : 0;
+    *done = 0;
+
+    while (count) {
+        const UINT this_count = au && sector % au + count > au ? au - sector % au : count;
+
+        if (-1 == session_write_within_au(buff, sector, this_count, au)) {
+            *done += spi_sd_blocks_done();
+            return -1;
+        }
+
+        if (buff) buff += 512 * this_count;
+        sector += this_count;
+        count -= this_count;
+        *done += this_count;
+    }
 
-    diskio_initted = 1;
     return 0;
 }
 
-static LBA_t deferred_zeros_sector_start = 0;
-static UINT deferred_zeros_sector_count = 0;
+static int card_session_read(BYTE * buff, LBA_t sector, UINT count, UINT * done) {
+    *done = 0;
+    session_continue_or_close(SESSION_READ, sector);
 
-static DRESULT flush_deferred_zeros(void) {
-    const UINT count = deferred_zeros_sector_count;
-    deferred_zeros_sector_count = 0;
+    if (!session_open) {
+        if (-1 == spi_sd_read_blocks_start(sector)) return -1;
+        session_open = SESSION_READ;
+        read_sessions_started++;
+    }
 
-    for (size_t ipass = 0;; ipass++) {
-        if (ipass > 0) {
-            if (verbose >= 1)
-                dprintf(2, "%s: retrying at lower baud rate %u\r\n", __func__, (unsigned)ipass + 1);
-            if (-1 == spi_sd_init(ipass)) continue;
+    /* on failure this has already deselected the card and disabled the peripheral */
+    if (-1 == spi_sd_read_some_blocks(buff, count)) {
+        session_open = SESSION_NONE;
+        *done = spi_sd_blocks_done();
+        return -1;
+    }
+
+    session_advance(sector + count);
+    *done = count;
+    return 0;
+}
+
+/* with more than one card, consecutive runs of STRIPE_SECTORS sectors go to each card in
+ turn, and the volume is as large as the smallest card allows. each card has its own
+ multi-block session, which is closed when the other card is selected, but without waiting
+ for the card to finish, so that one card can be busy with the end of one stripe while the
+ other is receiving the next */
+#define STRIPE_SECTORS 128
+
+static unsigned card_selected = 0;
+
+/* cards that have had sectors transferred since the rate controller, see below, last counted
+ a clean transfer */
+static unsigned cards_transferred = 0;
+
+static unsigned baud_step_of(unsigned card);
+
+static void card_select(const unsigned card) {
+    if (card == card_selected) return;
+
+    session_close();
+    spi_sd_select(card);
+    card_selected = card;
+    spi_sd_reduce_baud_rate(baud_step_of(card));
+}
+
+/* returns the sector within whichever card holds the given sector of the volume, and how
+ many sectors from there on are on the same card */
+static LBA_t stripe_map(const LBA_t sector, unsigned * card, UINT * run) {
+    if (1 == SDCARD_SLOTS) {
+        *card = 0;
+        *run = UINT_MAX;
+        return sector;
+    }
+
+    const LBA_t stripe = sector / STRIPE_SECTORS, offset = sector % STRIPE_SECTORS;
+    *card = stripe % SDCARD_SLOTS;
+    *run = STRIPE_SECTORS - offset;
+    return stripe / SDCARD_SLOTS * STRIPE_SECTORS + offset;
+}
+
+static void clock_boost_if_worthwhile(const unsigned char direction, const LBA_t sector, const UINT count) {
+    if (direction != streak_direction || sector != streak_next_sector) streak_sectors = 0;
+    streak_direction = direction;
+    streak_next_sector = sector + count;
+    streak_sectors += count;
+
+    if (clock_boosted || streak_sectors < CLOCK_BOOST_MIN_SECTORS) return;
+
+    /* the clocks must not change under an open transfer */
+    session_close();
+    clock_boosted = 1;
+    clock_boost_request();
+}
+
+/* these split a transfer wherever it crosses from one card to the other. on failure, done
+ is set to however many of the blocks were confirmed, counting from the first */
+static int session_write(const BYTE * buff, LBA_t sector, UINT count, UINT * done) {
+    *done = 0;
+    clock_boost_if_worthwhile(SESSION_WRITE, sector, count);
+
+    while (count) {
+        unsigned card;
+        UINT run, this_done;
+        const LBA_t card_sector = stripe_map(sector, &card, &run);
+        const UINT this_count = count < run ? count : run;
+
+        card_select(card);
+        cards_transferred |= 1U << card;
+        if (-1 == card_session_write(buff, card_sector, this_count, &this_done)) {
+            *done += this_done;
+            return -1;
+        }
+
+        if (buff) buff += 512 * this_count;
+        sector += this_count;
+        count -= this_count;
+        *done += this_count;
+    }
+
+    return 0;
+}
+
+static int session_read(BYTE * buff, LBA_t sector, UINT count, UINT * done) {
+    *done = 0;
+    clock_boost_if_worthwhile(SESSION_READ, sector, count);
+
+    while (count) {
+        unsigned card;
+        UINT run, this_done;
+        const LBA_t card_sector = stripe_map(sector, &card, &run);
+        const UINT this_count = count < run ? count : run;
+
+        card_select(card);
+        cards_transferred |= 1U << card;
+        if (-1 == card_session_read(buff, card_sector, this_count, &this_done)) {
+            *done += this_done;
+            return -1;
         }
 
+        buff += 512 * this_count;
+        sector += this_count;
+        count -= this_count;
+        *done += this_count;
+    }
+
+    return 0;
+}
+
+/* rate controller. every crc or response error divides the clock by one more, down to
+ 1/BAUD_STEPS of full speed, after which only the blocks that the card did not confirm are
+ retried, and the card is only reinitialized if it cannot be coaxed back into the transfer
+ state. the clock steps back up after BAUD_STEP_UP_TRANSFERS consecutive clean transfers,
+ doubled for every error ever seen at the faster setting, so that a marginal setting is
+ revisited less and less often */
+#define BAUD_STEPS 4
+#define BAUD_STEP_UP_TRANSFERS 64
+#define RECOVERY_ATTEMPTS 5
+
+/* each card has its own, since errors on one say nothing about the wiring of the other */
+static struct baud_controller {
+    unsigned step;
+    size_t clean_transfers;
+    size_t errors[BAUD_STEPS];
+} baud_controllers[SDCARD_SLOTS];
+
+size_t baud_steps_down = 0, baud_steps_up = 0, card_recoveries = 0, card_reinits = 0;
+
+/* time from the first failure to the eventual success of the transfer it interrupted */
+unsigned long recovery_us_last = 0, recovery_us_max = 0;
+
+static unsigned baud_step_of(const unsigned card) {
+    return baud_controllers[card].step;
+}
+
+/* a card that is not selected is set to its new step when it next is */
+static void baud_step_set(const unsigned card, const unsigned step) {
+    baud_controllers[card].step = step;
+    baud_controllers[card].clean_transfers = 0;
+    if (card != card_selected) return;
+
+    const unsigned baud = spi_sd_reduce_baud_rate(step);
+
+    if (verbose >= 1)
+        dprintf(2, "%s: card %u now at %u baud\r\n", __func__, card, baud);
+}
+
+/* counts a clean transfer for every card that took part in it */
+static void transfer_succeeded(void) {
+    for (unsigned card = 0; card < SDCARD_SLOTS; card++) {
+        struct baud_controller * controller = baud_controllers + card;
+        if (!(cards_transferred & 1U << card) || !controller->step) continue;
+
+        const size_t errors_above = controller->errors[controller->step - 1];
+        const size_t needed = (size_t)BAUD_STEP_UP_TRANSFERS << (errors_above < 8 ? errors_above : 8);
+        if (++controller->clean_transfers < needed) continue;
+
+        baud_steps_up++;
+        baud_step_set(card, controller->step - 1);
+    }
+
+    cards_transferred = 0;
+}
+
+/* steps the clock of the card that failed down, and gets it ready for the rest of the transfer */
+static int transfer_failed(void) {
+    struct baud_controller * controller = baud_controllers + card_selected;
+    controller->errors[controller->step]++;
+
+    if (controller->step + 1 < BAUD_STEPS) {
+        baud_steps_down++;
+        baud_step_set(card_selected, controller->step + 1);
+    }
+    else controller->clean_transfers = 0;
+
+    if (-1 != spi_sd_recover()) {
+        card_recoveries++;
+        return 0;
+    }
+
+    if (verbose >= 1)
+        dprintf(2, "%s: card did not recover, reinitializing\r\n", __func__);
+
+    card_reinits++;
+    if (-1 == spi_sd_init(controller->step)) return -1;
+    spi_sd_reduce_baud_rate(controller->step);
+    return 0;
+}
+
+static void transfer_recovered(const unsigned long timerawl_failed) {
+    recovery_us_last = timer_hw->timerawl - timerawl_failed;
+    if (recovery_us_last > recovery_us_max) recovery_us_max = recovery_us_last;
+
+    if (verbose >= 1)
+        dprintf(2, "%s: recovered in %lu us\r\n", __func__, recovery_us_last);
+}
+
+/* a null buffer means the sectors are all zeros */
+static DRESULT write_with_retries(const BYTE * buff, LBA_t sector, UINT count) {
+    unsigned long timerawl_failed = 0;
+
+    for (size_t iattempt = 0;; iattempt++) {
         fatfs_sectors_written += count;
 
-        if (spi_sd_write_blocks(NULL, count, deferred_zeros_sector_start) != -1) break;
-        if (ipass > 3) return RES_ERROR;
+        UINT done;
+        if (session_write(buff, sector, count, &done) != -1) {
+            if (iattempt) transfer_recovered(timerawl_failed);
+            transfer_succeeded();
+            return 0;
+        }
+
+        if (!iattempt) timerawl_failed = timer_hw->timerawl;
+
+        /* pick up where the card stopped confirming blocks */
+        if (buff) buff += 512 * done;
+        sector += done;
+        count -= done;
+
+        if (verbose >= 1)
+            dprintf(2, "%s: failed after %u blocks, retrying %u\r\n", __func__, done, count);
+
+        while (-1 == transfer_failed())
+            if (++iattempt >= RECOVERY_ATTEMPTS) return RES_ERROR;
+        if (iattempt + 1 >= RECOVERY_ATTEMPTS) return RES_ERROR;
+    }
+}
+
+static size_t cache_set(const LBA_t sector) {
+    /* consecutive sectors land in consecutive sets, but also fold in higher bits so that
+     sectors a power of two apart (e.g. the two fat copies) do not all collide */
+    return (sector ^ (sector >> 4) ^ (sector >> 8)) % CACHE_SETS;
+}
+
+/* called after a successful f_mount, so that the cache knows which sectors to pin */
+void disk_learn_layout(const FATFS * fs) {
+    metadata_range_count = 0;
+
+    /* all copies of the fat */
+    metadata_ranges[metadata_range_count++] = (struct sector_range) {
+        .start = fs->fatbase, .count = (LBA_t)fs->n_fats * fs->fsize };
+
+    /* fixed size root directory region between the fats and the data region, or else the
+     first cluster of the root directory, which holds everything for a typical logger */
+    if (FS_FAT12 == fs->fs_type || FS_FAT16 == fs->fs_type)
+        metadata_ranges[metadata_range_count++] = (struct sector_range) {
+            .start = fs->dirbase, .count = fs->database - fs->dirbase };
+    else
+        metadata_ranges[metadata_range_count++] = (struct sector_range) {
+            .start = fs->database + (LBA_t)fs->csize * (fs->dirbase - 2), .count = fs->csize };
+
+#if FF_FS_EXFAT
+    /* the allocation bitmap is walked in the same way as the fat on exfat */
+    if (FS_EXFAT == fs->fs_type)
+        metadata_ranges[metadata_range_count++] = (struct sector_range) {
+            .start = fs->bitbase, .count = (fs->n_fatent - 2 + 4095) / 4096 };
+#endif
+
+    if (verbose >= 2)
+        for (size_t irange = 0; irange < metadata_range_count; irange++)
+            dprintf(2, "%s: pinning sectors %u to %u\r\n", __func__, (unsigned)metadata_ranges[irange].start,
+                    (unsigned)(metadata_ranges[irange].start + metadata_ranges[irange].count - 1));
+}
+
+/* returns the first way that a given sector may be placed in */
+static size_t cache_first_way(const LBA_t sector) {
+    if (!metadata_range_count) return 0;
+
+    for (size_t irange = 0; irange < metadata_range_count; irange++)
+        if (sector - metadata_ranges[irange].start < metadata_ranges[irange].count)
+            return 0;
+
+    return CACHE_PINNED_WAYS;
+}
+
+static struct cache_tag * cache_find(const LBA_t sector) {
+    struct cache_tag * tags = cache_tags + cache_set(sector) * CACHE_WAYS;
+    for (size_t iway = 0; iway < CACHE_WAYS; iway++)
+        if (tags[iway].valid && tags[iway].sector == sector) {
+            tags[iway].referenced = 1;
+            return tags + iway;
+        }
+    return NULL;
+}
+
+static unsigned char * cache_data_of(const struct cache_tag * tag) {
+    return cache_data[tag - cache_tags];
+}
+
+/* returns NULL if the sector is not already cached and every way in its set is dirty */
+static struct cache_tag * cache_insert(const LBA_t sector) {
+    struct cache_tag * existing = cache_find(sector);
+    if (existing) return existing;
+
+    const size_t iset = cache_set(sector);
+    struct cache_tag * tags = cache_tags + iset * CACHE_WAYS;
+
+    /* advance the clock hand over the ways this sector may use, clearing reference bits,
+     until an unreferenced clean way is found. after two revolutions every reference bit
+     has been cleared, so give up */
+    const size_t first_way = cache_first_way(sector);
+    size_t iway = cache_hands[iset] < first_way ? first_way : cache_hands[iset];
+    for (size_t istep = 0; tags[iway].valid && (tags[iway].referenced || tags[iway].dirty); istep++) {
+        if (2 * (CACHE_WAYS - first_way) == istep) return NULL;
+        tags[iway].referenced = 0;
+        iway = iway + 1 < CACHE_WAYS ? iway + 1 : first_way;
+    }
+    cache_hands[iset] = iway + 1 < CACHE_WAYS ? iway + 1 : first_way;
+
+    if (tags[iway].valid) cache_evictions++;
+
+    tags[iway].sector = sector;
+    tags[iway].valid = 1;
+    tags[iway].referenced = 1;
+    tags[iway].dirty = 0;
+    return tags + iway;
+}
+
+static void cache_mark_clean(struct cache_tag * tag) {
+    if (!tag->dirty) return;
+    tag->dirty = 0;
+    cache_dirty_count--;
+}
+
+static void cache_mark_dirty(struct cache_tag * tag) {
+    if (tag->dirty) return;
+    tag->dirty = 1;
+
+    if (!(cache_dirty_count++)) {
+        cache_dirty_oldest_timerawl = timer_hw->timerawl;
+        service_alarm_rearm();
+    }
+}
+
+/* writes every dirty sector in ascending order, so that runs of consecutive sectors go out
+ within the same multi-block write session */
+static DRESULT cache_flush(void) {
+    if (!cache_dirty_count) return 0;
+
+    unsigned char sorted[CACHE_SETS * CACHE_WAYS];
+    size_t count = 0;
+
+    for (size_t itag = 0; itag < CACHE_SETS * CACHE_WAYS; itag++) {
+        if (!cache_tags[itag].dirty) continue;
+
+        /* insertion sort, there are at most a few dozen of these */
+        size_t iinsert = count++;
+        for (; iinsert && cache_tags[sorted[iinsert - 1]].sector > cache_tags[itag].sector; iinsert--)
+            sorted[iinsert] = sorted[iinsert - 1];
+        sorted[iinsert] = itag;
+    }
+
+    if (verbose >= 2)
+        dprintf(2, "%s: writing back %u dirty sectors\r\n", __func__, (unsigned)count);
+
+    cache_flushes++;
+
+    for (size_t isorted = 0; isorted < count; isorted++) {
+        struct cache_tag * tag = cache_tags + sorted[isorted];
+        const DRESULT res = write_with_retries(cache_data_of(tag), tag->sector, 1);
+        if (res) return res;
+        cache_mark_clean(tag);
     }
 
-    spi_sd_restore_baud_rate();
     return 0;
 }
 
-static void cache_block(const BYTE * buff, LBA_t sector) {
-    for (size_t icache_search = 0; icache_search < B; icache_search++)
-        if (sector && block_cache_sectors[icache_search] == sector) {
-            icache = icache_search;
-            break;
+/* returns 0 and fills the buffer only if every requested sector is cached */
+static int cache_load(BYTE * buff, const LBA_t sector, const UINT count) {
+    if (count > CACHE_BYPASS_SECTORS) return -1;
+
+    struct cache_tag * found[CACHE_BYPASS_SECTORS];
+    for (size_t isector = 0; isector < count; isector++)
+        if (!(found[isector] = cache_find(sector + isector))) {
+            cache_misses++;
+            return -1;
         }
 
-    __builtin_memcpy(block_cache[icache], buff, 512);
-    block_cache_sectors[icache] = sector;
-    icache = (icache + 1) % B;
+    for (size_t isector = 0; isector < count; isector++)
+        __builtin_memcpy(buff + 512 * isector, cache_data_of(found[isector]), 512);
+
+    cache_hits++;
+    return 0;
 }
 
-DRESULT disk_read(BYTE pdrv, BYTE * buff, LBA_t sector, UINT count) {
-    (void)pdrv;
+/* after reading from the card, replaces anything that has not been written back yet with
+ the newer cached copy, and caches the rest if the read was short enough */
+static void cache_merge_read(BYTE * buff, const LBA_t sector, const UINT count) {
+    for (size_t isector = 0; isector < count; isector++) {
+        struct cache_tag * tag = count <= CACHE_BYPASS_SECTORS ? cache_insert(sector + isector) : cache_find(sector + isector);
+        if (!tag) continue;
+
+        if (tag->dirty) __builtin_memcpy(buff + 512 * isector, cache_data_of(tag), 512);
+        else __builtin_memcpy(cache_data_of(tag), buff + 512 * isector, 512);
+    }
+}
+
+/* after writing to the card, updates any cached copies. a null buffer means all zeros */
+static void cache_store(const BYTE * buff, const LBA_t sector, const LBA_t count) {
+    /* for large ranges of zeros, it is cheaper to visit every cached sector than every
+     sector in the range */
+    if (!buff && count > CACHE_SETS * CACHE_WAYS) {
+        for (size_t itag = 0; itag < CACHE_SETS * CACHE_WAYS; itag++)
+            if (cache_tags[itag].valid && cache_tags[itag].sector - sector < count) {
+                __builtin_memset(cache_data[itag], 0, 512);
+                cache_mark_clean(cache_tags + itag);
+            }
+        return;
+    }
+
+    for (size_t isector = 0; isector < count; isector++) {
+        struct cache_tag * tag = count <= CACHE_BYPASS_SECTORS ? cache_insert(sector + isector) : NULL;
+        if (!tag) tag = cache_find(sector + isector);
+        if (!tag) continue;
+
+        if (buff) __builtin_memcpy(cache_data_of(tag), buff + 512 * isector, 512);
+        else __builtin_memset(cache_data_of(tag), 0, 512);
+
+        /* whatever was pending for this sector has now been superseded */
+        cache_mark_clean(tag);
+    }
+}
+
+/* returns 0 if the sectors were absorbed into the cache without touching the card */
+static int cache_write_back_store(const BYTE * buff, const LBA_t sector, const UINT count) {
+    if (!cache_write_back || count > CACHE_BYPASS_SECTORS) return -1;
+
+    /* each sector is made dirty before the next is inserted, so that a later sector of the
+     same write that maps to the same set cannot take the way of an earlier one */
+    for (size_t isector = 0; isector < count; isector++) {
+        struct cache_tag * tag = cache_insert(sector + isector);
+
+        /* set is full of dirty sectors, so write everything back and try again. if that
+         fails, the caller writes all of these through, and updates whatever was cached */
+        if (!tag) {
+            if (cache_flush()) return -1;
+            if (!(tag = cache_insert(sector + isector))) return -1;
+        }
+
+        __builtin_memcpy(cache_data_of(tag), buff + 512 * isector, 512);
+        cache_mark_dirty(tag);
+    }
+
+    /* if this fails, the caller will attempt to write the same data through to the card */
+    if (cache_dirty_count > cache_dirty_max && cache_flush()) return -1;
+
+    return 0;
+}
+
+/* runs of all-zero sectors written by fatfs (typically when it clears a newly allocated
+ directory cluster) are not written until sync, or until there are too many separate runs
+ to keep track of. they are kept sorted by start sector, non-overlapping, and merged with
+ any that they touch, and reads within them are served from memory */
+#define DEFERRED_ZERO_RANGES 8
+
+static struct sector_range deferred_zeros[DEFERRED_ZERO_RANGES];
+static size_t deferred_zeros_count = 0;
+
+size_t deferred_zero_sectors_served = 0;
+
+/* if the card reads back erased blocks as zeros, runs of zeros at least this long are
+ erased rather than written, with only the ends not aligned to the erase granularity
+ being written */
+#define ERASE_MIN_SECTORS 128
+
+size_t sectors_erased = 0;
+
+static DRESULT zero_sectors(const LBA_t sector, const LBA_t count) {
+    const LBA_t unit = sd_card_info.erase_blocks;
 
-    if (deferred_zeros_sector_count) {
+    if (1 == SDCARD_SLOTS && sd_card_info.erased_to_zero && unit) {
+        const LBA_t first = (sector + unit - 1) / unit * unit, end = (sector + count) / unit * unit;
+
+        if (end > first && end - first >= ERASE_MIN_SECTORS) {
+            /* cannot erase while a multi-block read or write is in progress */
+            session_close();
+
+            if (verbose >= 2)
+                dprintf(2, "%s: erasing %u sectors starting at %u\r\n", __func__, (unsigned)(end - first), (unsigned)first);
+
+            if (-1 != spi_sd_erase_blocks(first, end - 1)) {
+                sectors_erased += end - first;
+                service_alarm_rearm();
+
+                if (first > sector) {
+                    const DRESULT res = write_with_retries(NULL, sector, first - sector);
+                    if (res) return res;
+                }
+
+                if (sector + count > end) return write_with_retries(NULL, end, sector + count - end);
+                return 0;
+            }
+
+            if (verbose >= 1)
+                dprintf(2, "%s: erase failed, writing zeros instead\r\n", __func__);
+        }
+    }
+
+    return write_with_retries(NULL, sector, count);
+}
+
+static DRESULT flush_deferred_zeros(void) {
+    while (deferred_zeros_count) {
+        const DRESULT res = zero_sectors(deferred_zeros[0].start, deferred_zeros[0].count);
+        if (res) return res;
+
+        deferred_zeros_count--;
+        __builtin_memmove(deferred_zeros, deferred_zeros + 1, sizeof(deferred_zeros[0]) * deferred_zeros_count);
+    }
+
+    return 0;
+}
+
+static DRESULT deferred_zeros_add(LBA_t sector, const LBA_t count) {
+    LBA_t end = sector + count;
+
+    /* absorb every existing range that overlaps or touches the new one */
+    struct sector_range kept[DEFERRED_ZERO_RANGES];
+    size_t kept_count = 0, iinsert = 0;
+    for (size_t irange = 0; irange < deferred_zeros_count; irange++) {
+        const struct sector_range range = deferred_zeros[irange];
+        if (range.start + range.count < sector)
+            iinsert = kept_count + 1;
+        else if (range.start <= end) {
+            if (range.start < sector) sector = range.start;
+            if (range.start + range.count > end) end = range.start + range.count;
+            continue;
+        }
+        kept[kept_count++] = range;
+    }
+
+    /* no room for another separate range, so write out all the others */
+    if (DEFERRED_ZERO_RANGES == kept_count) {
         const DRESULT res = flush_deferred_zeros();
         if (res) return res;
+        kept_count = 0;
+        iinsert = 0;
     }
 
-    for (size_t icache_search = 0; icache_search < B; icache_search++)
-        if (1 == count && sector && block_cache_sectors[icache_search] == sector) {
-            if (verbose >= 2)
-                dprintf(2, "%s(%d): reusing cached block %u at %u\r\n", __func__, __LINE__, (unsigned)sector, icache_search);
-            __builtin_memcpy(buff, block_cache[icache_search], 512);
-            return 0;
+    __builtin_memcpy(deferred_zeros, kept, sizeof(kept[0]) * iinsert);
+    deferred_zeros[iinsert] = (struct sector_range) { .start = sector, .count = end - sector };
+    __builtin_memcpy(deferred_zeros + iinsert + 1, kept + iinsert, sizeof(kept[0]) * (kept_count - iinsert));
+    deferred_zeros_count = kept_count + 1;
+    return 0;
+}
+
+/* called when nonzero data is about to be written over some sectors */
+static DRESULT deferred_zeros_remove(const LBA_t sector, const UINT count) {
+    const LBA_t end = sector + count;
+
+    /* at most one range can be split in two, since they do not overlap */
+    struct sector_range kept[DEFERRED_ZERO_RANGES + 1];
+    size_t kept_count = 0;
+    for (size_t irange = 0; irange < deferred_zeros_count; irange++) {
+        const struct sector_range range = deferred_zeros[irange];
+        const LBA_t range_end = range.start + range.count;
+
+        if (range_end <= sector || range.start >= end)
+            kept[kept_count++] = range;
+        else {
+            if (range.start < sector)
+                kept[kept_count++] = (struct sector_range) { .start = range.start, .count = sector - range.start };
+            if (range_end > end)
+                kept[kept_count++] = (struct sector_range) { .start = end, .count = range_end - end };
         }
+    }
+
+    /* no room for the split, so just write out the zeros before they are overwritten */
+    if (kept_count > DEFERRED_ZERO_RANGES) return flush_deferred_zeros();
+
+    __builtin_memcpy(deferred_zeros, kept, sizeof(kept[0]) * kept_count);
+    deferred_zeros_count = kept_count;
+    return 0;
+}
+
+/* returns 0 if every requested sector is pending zeros, otherwise zeros only those that are */
+static int deferred_zeros_overlay(BYTE * buff, const LBA_t sector, const UINT count) {
+    const LBA_t end = sector + count;
+    for (size_t irange = 0; irange < deferred_zeros_count; irange++) {
+        const LBA_t range_start = deferred_zeros[irange].start;
+        const LBA_t range_end = range_start + deferred_zeros[irange].count;
+        if (range_end <= sector || range_start >= end) continue;
+
+        const LBA_t overlap_start = range_start > sector ? range_start : sector;
+        const LBA_t overlap_end = range_end < end ? range_end : end;
+        __builtin_memset(buff + 512 * (overlap_start - sector), 0, 512 * (overlap_end - overlap_start));
+        deferred_zero_sectors_served += overlap_end - overlap_start;
+
+        if (overlap_end - overlap_start == count) return 0;
+    }
+    return -1;
+}
+
+void disk_service(void) {
+    if (session_open && timer_hw->timerawl - session_timerawl >= session_idle_us) {
+        if (verbose >= 2)
+            dprintf(2, "%s: closing idle session\r\n", __func__);
+        session_close();
+    }
+
+    if (cache_dirty_count && timer_hw->timerawl - cache_dirty_oldest_timerawl >= cache_dirty_max_age_us) {
+        if (cache_flush() && verbose >= 1)
+            dprintf(2, "%s: failed to write back dirty sectors\r\n", __func__);
+
+        /* do not leave the card selected until the session times out */
+        session_close();
+    }
+
+    if (clock_boosted && !session_open && !cache_dirty_count &&
+        timer_hw->timerawl - session_timerawl >= clock_boost_hold_us) {
+        if (verbose >= 2)
+            dprintf(2, "%s: releasing faster clocks\r\n", __func__);
+        clock_boosted = 0;
+        clock_boost_release();
+    }
+
+    if (spi_sd_session_held() && spi_sd_session_idle_us() >= driver_hold_us) {
+        if (verbose >= 2)
+            dprintf(2, "%s: releasing idle driver\r\n", __func__);
+        spi_sd_session_release();
+    }
+
+    if (-1 != service_alarm && !session_open && !cache_dirty_count && !spi_sd_session_held() && !clock_boosted) {
+        hw_clear_bits(&timer_hw->inte, 1U << service_alarm);
+        hw_clear_bits(&timer_hw->intr, 1U << service_alarm);
+        irq_clear(hardware_alarm_get_irq_num(service_alarm));
+        timer_hardware_alarm_unclaim(timer_hw, service_alarm);
+        service_alarm = -1;
+    }
+    else service_alarm_rearm();
+}
+
+/* called before power is removed from the card: gives back whatever the block device code
+ is holding, and makes the next disk_initialize() start over with whatever card is present */
+void disk_release(void) {
+    if (clock_boosted) {
+        clock_boosted = 0;
+        clock_boost_release();
+    }
+
+    spi_sd_session_release();
+    diskio_initted = 0;
+}
+
+DSTATUS disk_initialize(BYTE pdrv) {
+    (void)pdrv;
+    if (!diskio_initted) {
+        /* anything that was open or dirty was lost when the card was power cycled, and
+         the card may not even be the same one */
+        session_open = SESSION_NONE;
+        metadata_range_count = 0;
+        deferred_zeros_count = 0;
+
+        for (unsigned card = SDCARD_SLOTS; card--; ) {
+            spi_sd_select(card);
+            card_selected = card;
+
+            for (size_t ipass = 0;; ipass++) {
+                if (ipass > 0 && verbose >= 1)
+                    dprintf(2, "%s: retrying at lower baud rate %u\r\n", __func__, (unsigned)ipass + 1);
+                if (spi_sd_init(ipass) != -1) break;
+                if (ipass > 3) return STA_NOINIT;
+            }
+
+            /* whatever the card was, this one starts again at whatever speed was negotiated */
+            baud_step_set(card, 0);
+        }
+    }
+    else if (flush_deferred_zeros() || cache_flush()) return STA_NOINIT;
+
+    __builtin_memset(cache_tags, 0, sizeof(cache_tags));
+    cache_dirty_count = 0;
+
+    diskio_initted = 1;
+    return 0;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE * buff, LBA_t sector, UINT count) {
+    (void)pdrv;
+
+    if (-1 != deferred_zeros_overlay(buff, sector, count)) {
+        if (verbose >= 2)
+            dprintf(2, "%s(%d): %u blocks starting at %u are pending zeros\r\n", __func__, __LINE__, count, (unsigned)sector);
+        return 0;
+    }
+
+    if (-1 != cache_load(buff, sector, count)) {
+        if (verbose >= 2)
+            dprintf(2, "%s(%d): reusing %u cached blocks starting at %u\r\n", __func__, __LINE__, count, (unsigned)sector);
+        return 0;
+    }
 
     if (verbose >= 2)
         dprintf(2, "%s(%d): reading %u blocks starting at %u\r\n", __func__, __LINE__, count, (unsigned)sector);
 
-    for (size_t ipass = 0;; ipass++) {
-        if (ipass > 0) {
-            if (verbose >= 1)
-                dprintf(2, "%s: retrying at lower baud rate %u\r\n", __func__, (unsigned)ipass + 1);
-            if (-1 == spi_sd_init(ipass)) continue;
-        }
+    unsigned long timerawl_failed = 0;
+    BYTE * remaining_buff = buff;
+    LBA_t remaining_sector = sector;
+    UINT remaining_count = count;
 
-        fatfs_sectors_read += count;
+    for (size_t iattempt = 0;; iattempt++) {
+        fatfs_sectors_read += remaining_count;
 
         /* this will block, but will internally call yield() and __WFI() */
-        if (spi_sd_read_blocks(buff, count, sector) != -1) break;
-        if (ipass > 3) return RES_ERROR;
+        UINT done;
+        if (session_read(remaining_buff, remaining_sector, remaining_count, &done) != -1) {
+            if (iattempt) transfer_recovered(timerawl_failed);
+            transfer_succeeded();
+            break;
+        }
+
+        if (!iattempt) timerawl_failed = timer_hw->timerawl;
+
+        /* blocks that arrived with a good crc do not need to be read again */
+        remaining_buff += 512 * done;
+        remaining_sector += done;
+        remaining_count -= done;
+
+        if (verbose >= 1)
+            dprintf(2, "%s: failed after %u blocks, retrying %u\r\n", __func__, done, remaining_count);
+
+        while (-1 == transfer_failed())
+            if (++iattempt >= RECOVERY_ATTEMPTS) return RES_ERROR;
+        if (iattempt + 1 >= RECOVERY_ATTEMPTS) return RES_ERROR;
     }
 
-    cache_block(buff, sector);
+    /* anything the card returned for sectors that are pending zeros is stale */
+    deferred_zeros_overlay(buff, sector, count);
+
+    cache_merge_read(buff, sector, count);
 
-    spi_sd_restore_baud_rate();
     return 0;
 }
 
 static int buffer_points_to_all_zeros(const BYTE * buff, UINT count) {
-    for (size_t ibyte = 0; ibyte < 512 * count; ibyte++)
-        if (buff[ibyte]) return 0;
+    const BYTE * const end = buff + 512 * count;
+
+    /* bytewise until aligned, then a word at a time, then bytewise for whatever is left */
+    for (; ((uintptr_t)buff & 3) && buff < end; buff++)
+        if (*buff) return 0;
+
+    typedef uint32_t __attribute((may_alias)) aliased_word;
+    for (; buff + 4 <= end; buff += 4)
+        if (*(const aliased_word *)buff) return 0;
+
+    for (; buff < end; buff++)
+        if (*buff) return 0;
+
     return 1;
 }
 
 DRESULT disk_write(BYTE pdrv, const BYTE * buff, LBA_t sector, UINT count) {
     (void)pdrv;
 
-    if (!deferred_zeros_sector_count || sector == deferred_zeros_sector_start + deferred_zeros_sector_count) {
-        if (buffer_points_to_all_zeros(buff, count)) {
-            if (!deferred_zeros_sector_count)
-                deferred_zeros_sector_start = sector;
-            deferred_zeros_sector_count += count;
-            return 0;
-        }
-    }
-    else if (deferred_zeros_sector_count) {
-        const DRESULT res = flush_deferred_zeros();
+    if (buffer_points_to_all_zeros(buff, count)) {
+        const DRESULT res = deferred_zeros_add(sector, count);
         if (res) return res;
-    }
-
-    if (verbose >= 2)
-        dprintf(2, "%s(%d): writing block(s) starting at %u\r\n", __func__, __LINE__, (unsigned)sector);
 
-    for (size_t ipass = 0;; ipass++) {
-        if (ipass > 0) {
-            if (verbose >= 1)
-                dprintf(2, "%s: retrying at lower baud rate %u\r\n", __func__, (unsigned)ipass + 1);
-            if (-1 == spi_sd_init(ipass)) continue;
-        }
+        /* reads check the cache after the deferred zeros, but keep it coherent anyway */
+        cache_store(NULL, sector, count);
+        return 0;
+    }
 
-        fatfs_sectors_written += count;
+    /* whatever zeros were pending for these sectors have now been superseded */
+    const DRESULT res_zeros = deferred_zeros_remove(sector, count);
+    if (res_zeros) return res_zeros;
 
-        if (spi_sd_write_blocks(buff, count, sector) != -1) break;
-        if (ipass > 3) return RES_ERROR;
+    if (-1 != cache_write_back_store(buff, sector, count)) {
+        if (verbose >= 2)
+            dprintf(2, "%s(%d): caching block(s) starting at %u\r\n", __func__, __LINE__, (unsigned)sector);
+        return 0;
     }
 
-    cache_block(buff, sector);
+    if (verbose >= 2)
+        dprintf(2, "%s(%d): writing block(s) starting at %u\r\n", __func__, __LINE__, (unsigned)sector);
+
+    const DRESULT res = write_with_retries(buff, sector, count);
+    if (res) return res;
 
-    spi_sd_restore_baud_rate();
+    cache_store(buff, sector, count);
     return 0;
 }
 
 DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void * buff) {
     (void)pdrv;
     if (CTRL_SYNC == cmd) {
-        if (deferred_zeros_sector_count) {
-            const DRESULT res = flush_deferred_zeros();
-            if (res) return res;
+        const DRESULT res_zeros = flush_deferred_zeros();
+        if (res_zeros) return res_zeros;
+
+        const DRESULT res = cache_flush();
+        if (res) return res;
+
+        session_close();
+
+        /* everything must actually be on every card before this returns */
+        for (unsigned card = 0; card < SDCARD_SLOTS; card++) {
+            card_select(card);
+            if (-1 == spi_sd_wait_ready()) return RES_ERROR;
+        }
+
+        if (sectors_lost_unreported) {
+            sectors_lost_unreported = 0;
+            return RES_ERROR;
         }
         return 0;
     }
-    else if (GET_BLOCK_SIZE == cmd)
-        *(LBA_t *)buff = 1; /* TODO: populate this from actual */
-    else if (GET_SECTOR_COUNT == cmd)
-        *(LBA_t *)buff = INT_MAX; /* TODO: populate this from actual */
+#if FF_USE_TRIM
+    else if (CTRL_TRIM == cmd) {
+        /* the contents of trimmed sectors are unspecified, so if the card erases to zeros
+         and the range is worth erasing, treat it like any other deferred run of zeros */
+        const LBA_t * range = buff;
+        const LBA_t count = range[1] + 1 - range[0];
+        if (SDCARD_SLOTS > 1 || !sd_card_info.erased_to_zero || count < ERASE_MIN_SECTORS) return 0;
+
+        const DRESULT res = deferred_zeros_add(range[0], count);
+        if (res) return res;
+
+        cache_store(NULL, range[0], count);
+        return 0;
+    }
+#endif
+    else if (GET_BLOCK_SIZE == cmd) {
+        /* fatfs wants the erase block size as a power of two no larger than 32768, and the
+         allocation unit, where known, is the size that matters for performance, unless the
+         volume is striped, in which case it is one stripe on every card */
+        const unsigned long blocks = SDCARD_SLOTS > 1 ? STRIPE_SECTORS * SDCARD_SLOTS :
+            sd_card_info.au_blocks ? sd_card_info.au_blocks : sd_card_info.erase_blocks;
+        const unsigned long power_of_two = blocks & -blocks;
+        *(DWORD *)buff = !power_of_two ? 1 : power_of_two < 32768 ? power_of_two : 32768;
+    }
+    else if (GET_SECTOR_COUNT == cmd) {
+        if (1 == SDCARD_SLOTS) {
+            if (!sd_card_info.blocks) return RES_ERROR;
+            *(LBA_t *)buff = sd_card_info.blocks;
+            return 0;
+        }
+
+        /* whole stripes, on however many cards, limited by the smallest card */
+        unsigned long long blocks = ULLONG_MAX;
+        for (unsigned card = 0; card < SDCARD_SLOTS; card++) {
+            card_select(card);
+            if (sd_card_info.blocks < blocks) blocks = sd_card_info.blocks;
+        }
+        if (!blocks) return RES_ERROR;
+        *(LBA_t *)buff = blocks / STRIPE_SECTORS * STRIPE_SECTORS * SDCARD_SLOTS;
+    }
     else return RES_PARERR;
     return 0;
 }
@@ -22,17 +22,18 @@
 #include "rp2350_sdcard.h"
 #include "cooperative_fatfs.h"
 #include "rp2350_cooperative_uart.h"
+#include "rp2350_storage_core.h"
+#include "cooperative_tasks.h"
 
 /* third party includes */
 #include "ff.h"
+#include "diskio.h"
 
 /* c standard includes */
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
-extern void yield(void);
-
 volatile unsigned char verbose = 0;
 
 __attribute((weak))
@@ -81,6 +82,103 @@ void run_from_xosc(void) {
     while (rosc_hw->status & ROSC_STATUS_STABLE_BITS);
 }
 
+/* if nonzero, clk_sys runs from pll_sys while the diskio layer asks for it. can be set to 0
+ at build time, and must be if the diskio layer is not on this core */
+#ifndef CLOCK_GOVERNOR
+#define CLOCK_GOVERNOR 1
+#endif
+
+#if CLOCK_GOVERNOR && STORAGE_ON_CORE1
+#error "the clock governor cannot change clocks out from under core1, build with -DCLOCK_GOVERNOR=OFF"
+#endif
+
+#if CLOCK_GOVERNOR
+/* clk_sys while there is a lot of data to move, a 1500 MHz vco divided by 5 and then 2 */
+#define PLL_SYS_MHZ 150
+
+/* 0: always run from xosc, 1: run from pll_sys while the diskio layer asks for it, 2: once
+ asked, stay on pll_sys until the policy is changed */
+unsigned char clock_policy = 1;
+static unsigned clock_boost_requests = 0;
+static unsigned char clocks_boosted = 0;
+
+size_t clock_boosts = 0;
+unsigned long long clock_boosted_us = 0;
+static unsigned long long clock_boosted_since;
+
+/* rough power draw of the chip, not including the card, in each clock mode. there is no way
+ to measure this from here, so replace these with numbers from a meter on the actual board.
+ the energy figures printed by clockbench are only ever these times the time at each clock */
+unsigned power_mw_xosc = 15, power_mw_pll = 75;
+
+static void clocks_set_boosted(const unsigned char boosted) {
+    if (boosted == clocks_boosted) return;
+
+    /* let whatever is already in the uart fifo go out at the current baud rate */
+    uart_tx_wait_blocking_with_yield();
+
+    const uint32_t interrupts = save_and_disable_interrupts();
+
+    if (boosted) {
+        hw_set_bits(&clocks_hw->wake_en0, CLOCKS_WAKE_EN0_CLK_SYS_PLL_SYS_BITS);
+        hw_set_bits(&clocks_hw->sleep_en0, CLOCKS_SLEEP_EN0_CLK_SYS_PLL_SYS_BITS);
+        pll_init(pll_sys, 1, 1500 * MHZ, 5, 2);
+
+        clock_configure_undivided(clk_sys, CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLKSRC_CLK_SYS_AUX,
+                                  CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_SYS, PLL_SYS_MHZ * MHZ);
+        clock_configure_undivided(clk_peri, 0, CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLK_SYS, PLL_SYS_MHZ * MHZ);
+        clock_boosted_since = timer_time_us_64(timer_hw);
+        clock_boosts++;
+    } else {
+        clock_configure_undivided(clk_sys, CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLK_REF, 0, XOSC_MHZ * MHZ);
+        clock_configure_undivided(clk_peri, 0, CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLK_SYS, XOSC_MHZ * MHZ);
+
+        pll_deinit(pll_sys);
+        hw_clear_bits(&clocks_hw->wake_en0, CLOCKS_WAKE_EN0_CLK_SYS_PLL_SYS_BITS);
+        hw_clear_bits(&clocks_hw->sleep_en0, CLOCKS_SLEEP_EN0_CLK_SYS_PLL_SYS_BITS);
+        clock_boosted_us += timer_time_us_64(timer_hw) - clock_boosted_since;
+    }
+
+    clocks_boosted = boosted;
+    cooperative_uart_clock_changed();
+    restore_interrupts(interrupts);
+
+    /* dividers and anything else derived from clk_sys or clk_peri */
+    spi_sd_clock_changed();
+}
+
+/* overrides the weak no-op versions in diskio.c, which only calls these between transfers */
+void clock_boost_request(void) {
+    clock_boost_requests++;
+    if (clock_policy) clocks_set_boosted(1);
+}
+
+void clock_boost_release(void) {
+    if (!--clock_boost_requests && clock_policy != 2) clocks_set_boosted(0);
+}
+
+/* exposed by diskio.c, nonzero while there is an initialized card to sync */
+extern unsigned char diskio_initted;
+
+static void clock_policy_set(const unsigned char policy) {
+    /* like diskio.c, never change the clocks under an open transfer, so wait for whoever is
+     using the card, and close whatever they left open */
+    card_lock();
+    if (diskio_initted) disk_ioctl(0, CTRL_SYNC, NULL);
+
+    clock_policy = policy;
+
+    /* dropping back is only safe here if the diskio layer is not relying on the faster clocks */
+    if (!clock_boost_requests && policy != 2) clocks_set_boosted(0);
+
+    card_unlock();
+}
+
+static unsigned long long clock_boosted_us_now(void) {
+    return clock_boosted_us + (clocks_boosted ? timer_time_us_64(timer_hw) - clock_boosted_since : 0);
+}
+#endif
+
 void lower_power_sleep_ms(const unsigned delay_ms) {
     /* get a timer, enable interrupt for alarm, but leave it disabled in nvic */
     const unsigned alarm_num = timer_hardware_alarm_claim_unused(timer_hw, true);
@@ -117,8 +215,9 @@ void enable_line_request(void) {
         gpio_set_dir(22, GPIO_OUT);
         gpio_put(22, 1);
 
-        /* wait for inrush current, must also be > 1 ms for sdmmc */
-        lower_power_sleep_ms(50);
+        /* wait for inrush current, must also be > 1 ms for sdmmc. the shorter wait assumes
+         the supply to the card ramps up well within 1 ms, which should be checked on a scope */
+        lower_power_sleep_ms(sd_startup_fast ? 2 : 50);
     }
 
     locked = 0;
@@ -163,6 +262,240 @@ static int touch(const char * path) {
     return -1;
 }
 
+/* these are exposed by diskio.c */
+extern unsigned long session_idle_us;
+extern size_t write_sessions_started, read_sessions_started;
+extern size_t cache_hits, cache_misses, cache_evictions, cache_flushes, deferred_zero_sectors_served;
+extern unsigned char cache_write_back, au_staging;
+extern unsigned long write_session_busy_us_max;
+extern size_t baud_steps_down, baud_steps_up, card_recoveries, card_reinits, sectors_lost;
+extern unsigned long recovery_us_last, recovery_us_max;
+
+/* these are exposed by rp2350_sdcard.c */
+extern size_t card_ready_waits, card_ready_waits_immediate;
+extern unsigned long card_ready_wake_us_min, card_ready_wake_us_max, card_ready_wake_us_total;
+extern unsigned long isr_dma_1_cycles_max, isr_pio1_0_cycles_max, isr_pio1_1_cycles_max;
+extern size_t sd_session_setups, sd_session_setups_saved;
+extern unsigned long long sd_session_setup_cycles;
+extern unsigned long sd_session_idle_us;
+
+/* these are exposed by rp2350_storage_core.c */
+extern size_t storage_requests;
+extern unsigned long storage_request_us_max;
+
+static int bench_write(const char * path, const unsigned kilobytes, unsigned long * microseconds) {
+    if (-1 == card_request()) return -1;
+
+    do {
+        /* large thing on stack */
+        FIL * fp = &(FIL) { };
+        FRESULT fres;
+
+        /* nonzero so that none of it is deferred as zeros */
+        __attribute((aligned(4))) static unsigned char buf[4096];
+        for (size_t ibyte = 0; ibyte < sizeof(buf); ibyte++)
+            buf[ibyte] = ibyte | 1;
+
+        if ((fres = f_open(fp, path, FA_CREATE_ALWAYS | FA_WRITE))) {
+            dprintf(2, "%s: f_open(\"%s\"): %d\r\n", __func__, path, fres);
+            break;
+        }
+
+        const unsigned long long uptime_start = timer_time_us_64(timer_hw);
+
+        UINT write_count = sizeof(buf);
+        for (size_t ichunk = 0; ichunk < kilobytes / 4 && sizeof(buf) == write_count; ichunk++)
+            if ((fres = f_write(fp, buf, sizeof(buf), &write_count))) break;
+
+        if (fres || write_count < sizeof(buf)) {
+            dprintf(2, "%s: f_write(): %d\r\n", __func__, fres);
+            f_close(fp);
+            break;
+        }
+
+        if ((fres = f_close(fp))) {
+            dprintf(2, "%s: f_close(\"%s\"): %d\r\n", __func__, path, fres);
+            break;
+        }
+
+        *microseconds = timer_time_us_64(timer_hw) - uptime_start;
+
+        card_release();
+        return 0;
+    } while(0);
+
+    card_release();
+    return -1;
+}
+
+static int bench_read(const char * path, unsigned long * microseconds) {
+    if (-1 == card_request()) return -1;
+
+    do {
+        /* large thing on stack */
+        FIL * fp = &(FIL) { };
+        FRESULT fres;
+
+        __attribute((aligned(4))) static unsigned char buf[4096];
+
+        if ((fres = f_open(fp, path, FA_READ))) {
+            dprintf(2, "%s: f_open(\"%s\"): %d\r\n", __func__, path, fres);
+            break;
+        }
+
+        const unsigned long long uptime_start = timer_time_us_64(timer_hw);
+
+        UINT read_count = sizeof(buf);
+        while (sizeof(buf) == read_count)
+            if ((fres = f_read(fp, buf, sizeof(buf), &read_count))) break;
+
+        f_close(fp);
+
+        if (fres) {
+            dprintf(2, "%s: f_read(): %d\r\n", __func__, fres);
+            break;
+        }
+
+        *microseconds = timer_time_us_64(timer_hw) - uptime_start;
+
+        card_release();
+        return 0;
+    } while(0);
+
+    card_release();
+    return -1;
+}
+
+static void bench(const unsigned kilobytes) {
+    const unsigned long session_idle_us_saved = session_idle_us;
+
+    for (size_t ipass = 0; ipass < 2; ipass++) {
+        /* first pass closes the multi-block read or write after every call, as before */
+        session_idle_us = ipass ? session_idle_us_saved : 0;
+
+        const size_t write_sessions_before = write_sessions_started;
+        write_session_busy_us_max = 0;
+        unsigned long microseconds;
+        if (-1 == bench_write("bench.bin", kilobytes, &microseconds)) break;
+
+        dprintf(2, "%s: %s write sessions: %u kB in %lu us, %lu kB/s, %zu cmd25, worst busy %lu us\r\n", PROGNAME,
+                ipass ? "with" : "without", kilobytes, microseconds,
+                (unsigned long)(kilobytes * 1000000ULL / (microseconds ? microseconds : 1)),
+                write_sessions_started - write_sessions_before, write_session_busy_us_max);
+
+        const size_t read_sessions_before = read_sessions_started;
+        if (-1 == bench_read("bench.bin", &microseconds)) break;
+
+        dprintf(2, "%s: %s read sessions: %u kB in %lu us, %lu kB/s, %zu cmd18\r\n", PROGNAME,
+                ipass ? "with" : "without", kilobytes, microseconds,
+                (unsigned long)(kilobytes * 1000000ULL / (microseconds ? microseconds : 1)),
+                read_sessions_started - read_sessions_before);
+    }
+
+    session_idle_us = session_idle_us_saved;
+}
+
+#if CLOCK_GOVERNOR
+/* time and estimated energy per megabyte for each clock policy */
+static void clockbench(const unsigned kilobytes) {
+    const unsigned char policy_saved = clock_policy;
+
+    dprintf(2, "%s: energy below is estimated from power_mw_xosc = %u and power_mw_pll = %u, not measured\r\n",
+            PROGNAME, power_mw_xosc, power_mw_pll);
+
+    for (unsigned char policy = 0; policy < 3; policy++) {
+        clock_policy_set(policy);
+
+        for (size_t ipass = 0; ipass < 2; ipass++) {
+            const unsigned long long start = timer_time_us_64(timer_hw), boosted_start = clock_boosted_us_now();
+
+            unsigned long microseconds;
+            if (-1 == (ipass ? bench_read("bench.bin", &microseconds) :
+                       bench_write("bench.bin", kilobytes, &microseconds))) break;
+
+            const unsigned long long elapsed = timer_time_us_64(timer_hw) - start;
+            const unsigned long long boosted = clock_boosted_us_now() - boosted_start;
+            const unsigned long long boosted_part = boosted < elapsed ? boosted : elapsed;
+
+            /* mW times us is nJ */
+            const unsigned long long nanojoules = boosted_part * power_mw_pll + (elapsed - boosted_part) * power_mw_xosc;
+
+            dprintf(2, "%s: policy %u %s: %lu us per MB, %lu us of %lu at pll, estimated %lu uJ per MB\r\n", PROGNAME,
+                    policy, ipass ? "read" : "write",
+                    (unsigned long)(microseconds * 1024ULL / (kilobytes ? kilobytes : 1)),
+                    (unsigned long)boosted_part, (unsigned long)elapsed,
+                    (unsigned long)(nanojoules * 1024ULL / (kilobytes ? kilobytes : 1) / 1000ULL));
+        }
+    }
+
+    clock_policy_set(policy_saved);
+}
+#endif
+
+static void info(void) {
+    if (-1 == card_request()) return;
+
+    const struct sd_card_info * card = &sd_card_info;
+    dprintf(2, "%s: mid 0x%02x oem %s product %s rev %u.%u serial 0x%08lx made %u-%02u\r\n", PROGNAME,
+            card->manufacturer_id, card->oem_id, card->product_name, card->product_revision >> 4,
+            card->product_revision & 0xF, card->serial_number, card->manufacture_year, card->manufacture_month);
+    dprintf(2, "%s: %llu blocks, sd spec %u, max %lu baud, speed class %u, uhs grade %u, au %lu blocks, "
+            "erase granularity %lu blocks, erases to %s\r\n", PROGNAME, card->blocks, card->sd_spec_version,
+            card->max_baud_rate, card->speed_class, card->uhs_speed_grade, card->au_blocks, card->erase_blocks,
+            card->erased_to_zero ? "zeros" : "ones");
+    dprintf(2, "%s: %s speed mode, running at %lu baud\r\n", PROGNAME,
+            card->high_speed ? "high" : "default", card->baud_rate);
+
+    card_release();
+}
+
+/* commands that use the card run one at a time in a task of their own, so that the command
+ loop keeps answering while they wait on the card */
+__attribute((aligned(8))) static unsigned char card_command_stack[8192];
+static char card_command_line[83];
+static volatile unsigned char card_command_running = 0;
+
+static int is_card_command(const char * line) {
+    static const char * const names[] = { "ls", "cat", "touch", "bench", "info",
+#if CLOCK_GOVERNOR
+        "clockbench",
+#endif
+    };
+    const size_t len = strcspn(line, " ");
+    for (size_t iname = 0; iname < sizeof(names) / sizeof(names[0]); iname++)
+        if (strlen(names[iname]) == len && !strncmp(line, names[iname], len)) return 1;
+    return 0;
+}
+
+static void card_command(void * arg) {
+    const char * line = arg;
+
+    if (line == strstr(line, "ls "))
+        ls(line + 3);
+    else if (!strcmp(line, "ls"))
+        ls(NULL);
+    else if (line == strstr(line, "cat "))
+        cat(line + 4);
+    else if (line == strstr(line, "touch "))
+        touch(line + 6);
+    else if (line == strstr(line, "bench "))
+        bench(strtoul(line + 6, NULL, 10));
+    else if (!strcmp(line, "bench"))
+        bench(1024);
+
+#if CLOCK_GOVERNOR
+    else if (line == strstr(line, "clockbench "))
+        clockbench(strtoul(line + 11, NULL, 10));
+    else if (!strcmp(line, "clockbench"))
+        clockbench(1024);
+#endif
+
+    else if (!strcmp(line, "info"))
+        info();
+
+    card_command_running = 0;
+}
+
 int main(void) {
     run_from_xosc();
 
@@ -207,6 +540,9 @@ int main(void) {
 
     cooperative_uart_init();
 
+    /* if enabled, everything below fatfs runs on core1 from here on */
+    storage_core_init();
+
     dprintf(2, "\r\n%s: built from %s\r\n", PROGNAME, GIT_VERSION);
 
     /* loop on characters from uart */
@@ -218,14 +554,88 @@ int main(void) {
             const unsigned long long uptime_now = timer_time_us_64(timer_hw);
             dprintf(2, "%% %s\r\n", line);
 
-            if (line == strstr(line, "ls "))
-                ls(line + 3);
-            else if (!strcmp(line, "ls"))
-                ls(NULL);
-            else if (line == strstr(line, "cat "))
-                cat(line + 4);
-            else if (line == strstr(line, "touch "))
-                touch(line + 6);
+            if (is_card_command(line)) {
+                if (card_command_running)
+                    dprintf(2, "%s: still busy with a previous command\r\n", PROGNAME);
+                else {
+                    strcpy(card_command_line, line);
+                    card_command_running = 1;
+                    task_create(card_command, card_command_line, card_command_stack, sizeof(card_command_stack));
+                }
+            }
+
+            else if (!strcmp(line, "tasks"))
+                dprintf(2, "%s: task switches %zu, passes %zu, card command %s\r\n", PROGNAME,
+                        task_switches, task_passes, card_command_running ? "running" : "idle");
+
+            else if (!strcmp(line, "cache"))
+                dprintf(2, "%s: cache hits %zu, misses %zu, evictions %zu, flushes %zu, zeros served %zu\r\n", PROGNAME,
+                        cache_hits, cache_misses, cache_evictions, cache_flushes, deferred_zero_sectors_served);
+
+            else if (!strcmp(line, "errors"))
+                dprintf(2, "%s: baud steps down %zu, up %zu, recoveries %zu, reinits %zu, last %lu us, worst %lu us, "
+                        "sectors lost %zu\r\n", PROGNAME, baud_steps_down, baud_steps_up, card_recoveries, card_reinits,
+                        recovery_us_last, recovery_us_max, sectors_lost);
+
+            else if (!strcmp(line, "waits"))
+                dprintf(2, "%s: busy waits %zu, immediate %zu, start to wake min %lu us, max %lu us, mean %lu us\r\n", PROGNAME,
+                        card_ready_waits, card_ready_waits_immediate, card_ready_waits ? card_ready_wake_us_min : 0,
+                        card_ready_wake_us_max, card_ready_waits ? card_ready_wake_us_total / card_ready_waits : 0);
+
+            else if (!strcmp(line, "isr"))
+                dprintf(2, "%s: worst case isr cycles: dma_1 %lu, pio1_0 %lu, pio1_1 %lu\r\n", PROGNAME,
+                        isr_dma_1_cycles_max, isr_pio1_0_cycles_max, isr_pio1_1_cycles_max);
+
+            else if (!strcmp(line, "session"))
+                dprintf(2, "%s: driver setups %zu, avoided %zu, mean setup and teardown %lu cycles, held idle %lu us\r\n", PROGNAME,
+                        sd_session_setups, sd_session_setups_saved,
+                        sd_session_setups ? (unsigned long)(sd_session_setup_cycles / sd_session_setups) : 0, sd_session_idle_us);
+#if STORAGE_ON_CORE1
+            else if (!strcmp(line, "storage"))
+                dprintf(2, "%s: requests to core1 %zu, longest %lu us\r\n", PROGNAME, storage_requests, storage_request_us_max);
+#endif
+
+#if CLOCK_GOVERNOR
+            else if (!strcmp(line, "clock"))
+                dprintf(2, "%s: clock policy %u, now at %u MHz, boosts %zu, %lu ms at pll\r\n", PROGNAME,
+                        clock_policy, clocks_boosted ? PLL_SYS_MHZ : XOSC_MHZ, clock_boosts,
+                        (unsigned long)(clock_boosted_us_now() / 1000ULL));
+
+            else if (line == strstr(line, "clock "))
+                clock_policy_set(strtoul(line + 6, NULL, 10));
+#endif
+
+            else if (!strcmp(line, "startup"))
+                dprintf(2, "%s: startup us: powered %lu, cmd0 %lu (%u tries), cmd8 %lu, acmd41 %lu (%u polls), "
+                        "init %lu, mount %lu, first write %lu\r\n", PROGNAME,
+                        sd_startup_us[SD_STARTUP_POWERED], sd_startup_us[SD_STARTUP_CMD0], sd_startup_cmd0_tries,
+                        sd_startup_us[SD_STARTUP_CMD8], sd_startup_us[SD_STARTUP_ACMD41], sd_startup_acmd41_polls,
+                        sd_startup_us[SD_STARTUP_INIT], sd_startup_us[SD_STARTUP_MOUNT],
+                        sd_startup_us[SD_STARTUP_FIRST_WRITE]);
+
+            else if (!strcmp(line, "mount"))
+                dprintf(2, "%s: mounts reused %zu, last %lu us, full %zu, last %lu us\r\n", PROGNAME,
+                        mounts_fast, mount_fast_us_last, mounts_full, mount_full_us_last);
+
+            else if (!strcmp(line, "linger"))
+                dprintf(2, "%s: linger %lu ms, remounts avoided %zu, expired %zu, %lu ms powered while idle\r\n", PROGNAME,
+                        card_linger_ms, card_remounts_avoided, card_linger_expiries,
+                        (unsigned long)(card_lingered_us / 1000ULL));
+
+            else if (line == strstr(line, "linger "))
+                card_linger_ms = strtoul(line + 7, NULL, 10);
+
+            else if (line == strstr(line, "fastremount "))
+                fast_remount = strtoul(line + 12, NULL, 10);
+
+            else if (line == strstr(line, "startupfast "))
+                sd_startup_fast = strtoul(line + 12, NULL, 10);
+
+            else if (line == strstr(line, "writeback "))
+                cache_write_back = strtoul(line + 10, NULL, 10);
+
+            else if (line == strstr(line, "austaging "))
+                au_staging = strtoul(line + 10, NULL, 10);
 
             else if (!strcmp(line, "flash")) {
                 dprintf(2, "%s: resetting into bootloader\r\n", PROGNAME);
@@ -240,6 +650,9 @@ int main(void) {
                 verbose = strtoul(line + 8, NULL, 10);
         }
 
+        /* close anything the diskio layer has left open for too long */
+        card_service();
+
         yield();
     }
 }
@@ -4,6 +4,7 @@
 #include "hardware/irq.h"
 #include "hardware/gpio.h"
 #include "hardware/sync.h"
+#include "hardware/structs/sio.h"
 #include "RP2350.h"
 
 __attribute((weak)) void yield(void) { }
@@ -42,6 +43,11 @@ static void uart0_handler(void) {
     }
 }
 
+static void uart0_doorbell_handler(void) {
+    sio_hw->doorbell_in_clr = 1U;
+    uart0_handler();
+}
+
 void uart_write_with_yield(const void * bytes, const size_t count) {
     const unsigned char * cursor = bytes, * stop = cursor + count;
     hw_set_bits(&uart_get_hw(uart0)->imsc, 1U << UART_UARTIMSC_TXIM_LSB);
@@ -62,7 +68,11 @@ void uart_write_with_yield(const void * bytes, const size_t count) {
 
         cursor += bytes_to_send_now;
         __DSB();
-        irq_set_pending(UART_IRQ_NUM(uart0));
+
+        /* the interrupt is only enabled on core0, and core1 cannot pend it there directly,
+         but can ring a doorbell whose handler on core0 does the same thing */
+        if (get_core_num()) sio_hw->doorbell_out_set = 1U;
+        else irq_set_pending(UART_IRQ_NUM(uart0));
     }
 }
 
@@ -90,15 +100,16 @@ int _write(int fd, void * bytes, int len) {
      calls __WFE() once per loop over all tasks */
     static volatile uintptr_t task_holding_lock = 0;
 
-    /* get a unique and nonzero identifier for the current task */
-    const uintptr_t me = (uintptr_t)current_task() + 1U;
+    /* get a unique and nonzero identifier for the current task on the current core */
+    const uintptr_t me = ((uintptr_t)current_task() << 1U | get_core_num()) + 1U;
 
     /* if we do not own the lock, it is either not locked or locked by another thread. the
-     fast path is that we already own the lock from a previous call */
-    if (task_holding_lock != me) {
-        while (task_holding_lock) yield();
-        task_holding_lock = me;
-    }
+     fast path is that we already own the lock from a previous call. the other core may be
+     trying to take it at the same time, so this must be an atomic compare and swap */
+    if (task_holding_lock != me)
+        for (uintptr_t unlocked = 0; !__atomic_compare_exchange_n(&task_holding_lock, &unlocked, me, 0,
+                                                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED); unlocked = 0)
+            yield();
 
     /* this can also internally call yield */
     uart_write_with_yield(bytes, len);
@@ -152,6 +163,12 @@ const char * get_line_from_uart(void) {
     return NULL;
 }
 
+/* call this after clk_peri changes, before interrupts are enabled again, so that nothing
+ goes out at the wrong baud rate */
+void cooperative_uart_clock_changed(void) {
+    uart_set_baudrate(uart0, 115200);
+}
+
 void cooperative_uart_init(void) {
     gpio_set_function(0, UART_FUNCSEL_NUM(uart0, 0));
     gpio_set_function(1, UART_FUNCSEL_NUM(uart0, 1));
@@ -161,6 +178,10 @@ void cooperative_uart_init(void) {
     irq_set_exclusive_handler(UART_IRQ_NUM(uart0), uart0_handler);
     irq_set_enabled(UART_IRQ_NUM(uart0), true);
 
+    /* lets code on core1 write to the uart */
+    irq_set_exclusive_handler(SIO_IRQ_BELL, uart0_doorbell_handler);
+    irq_set_enabled(SIO_IRQ_BELL, true);
+
     /* wake up when either fifo reaches 1/8 full, or when fifo is nonempty and a timeout elapses */
     hw_set_bits(&uart_get_hw(uart0)->imsc, 1U << UART_UARTIMSC_RXIM_LSB | 1U << UART_UARTIMSC_RTIM_LSB);
     hw_write_masked(&uart_get_hw(uart0)->ifls, 0 << UART_UARTIFLS_RXIFLSEL_LSB, 0);
@@ -8,4 +8,6 @@ const char * get_line_from_uart(void);
 
 void cooperative_uart_init(void);
 
+void cooperative_uart_clock_changed(void);
+
 int write(int fd, void * bytes, int len);
@@ -1,6 +1,7 @@
-/* this is going to start out as 1-bit spi mode, roughly following the logic in the
- equivalent samd51 code, but will then switch to 4-bit sdio mode using pio, with a set of
- pins chosen to allow either of those modes to work with no hardware change */
+/* this started out as 1-bit spi mode, roughly following the logic in the equivalent samd51
+ code, and can now also use 4-bit sdio mode using pio, with a set of pins chosen to allow
+ either of those modes to work with no hardware change. 4-bit mode is attempted first after
+ the card is powered up, and spi mode is used if that fails or on any subsequent retry */
 #include "hardware/sync.h"
 #include "hardware/dma.h"
 #include "hardware/spi.h"
@@ -11,11 +12,36 @@
 #include "RP2350.h"
 
 #include "rp2350_sdcard.h"
+#include "sd_protocol.h"
 #include "rp2350_sdcard.pio.h"
 
 static unsigned requested_baud_rate = 0;
 
+/* can be set to zero at build time to never attempt 4-bit mode */
+#ifndef SDCARD_4BIT
+#define SDCARD_4BIT 1
+#endif
+
+/* nonzero if the card has been put in 4-bit sd bus mode rather than spi mode */
+static unsigned char sdio_active = 0;
+
+/* spi peripheral and pins of each card slot. mosi and miso are always the two pins after
+ sck, so that the pio programs can drive sck and mosi as one group. only the first slot can
+ use 4-bit mode, on pins 10 through 15 */
+static const struct sd_card_slot {
+    unsigned char spi_index, pin_sck, pin_cs;
+} sd_card_slots[2] = { { 1, 10, 15 }, { 0, 18, 21 } };
+
+_Static_assert(SDCARD_SLOTS >= 1 && SDCARD_SLOTS <= 2, "only two card slots are defined");
+
+/* those of whichever card is currently selected */
+static spi_inst_t * card_spi = spi1;
+static unsigned pin_sck = 10, pin_mosi = 11, pin_miso = 12, pin_cs = 15;
+static uint32_t spi_clock_bits = CLOCKS_WAKE_EN1_CLK_SYS_SPI1_BITS | CLOCKS_WAKE_EN1_CLK_PERI_SPI1_BITS;
+static unsigned current_slot = 0;
+
 #include <stdio.h>
+#include <limits.h>
 
 unsigned long microseconds_in_wait = 0;
 unsigned long microseconds_in_data = 0;
@@ -26,17 +52,65 @@ __attribute((weak)) void yield(void) {
     __DSB(); __WFE();
 }
 
+/* sleeps for at least the given time, running other tasks meanwhile, using an alarm whose
+ interrupt is enabled in the timer but not in nvic, so that it only wakes up wfe */
+static void sleep_us_with_yield(const unsigned long microseconds) {
+    const unsigned alarm_num = timer_hardware_alarm_claim_unused(timer_hw, true);
+    hw_set_bits(&timer_hw->inte, 1U << alarm_num);
+    irq_set_enabled(hardware_alarm_get_irq_num(alarm_num), false);
+
+    timer_hw->alarm[alarm_num] = timer_hw->timerawl + microseconds;
+
+    while (!(timer_hw->intr & (1U << alarm_num)))
+        yield();
+
+    hw_clear_bits(&timer_hw->intr, 1U << alarm_num);
+    irq_clear(hardware_alarm_get_irq_num(alarm_num));
+    hw_clear_bits(&timer_hw->inte, 1U << alarm_num);
+    timer_hardware_alarm_unclaim(timer_hw, alarm_num);
+}
+
+/* the card is given this long to come out of idle after the first acmd41, per section 4.2.3
+ of the simplified physical spec, and is polled this often meanwhile */
+#define ACMD41_TIMEOUT_US 1000000
+#define ACMD41_POLL_US 2000
+#define ACMD41_POLL_US_FAST 250
+
+/* a card answers cmd0 within a try or two, so a run of these with nothing driving miso
+ means there is no card, rather than a slow one */
+#define CMD0_TRIES 16
+#define CMD0_POLL_US 1000
+
+unsigned char sd_startup_fast = 0;
+
+unsigned long sd_startup_us[SD_STARTUP_STAGES];
+unsigned sd_startup_cmd0_tries, sd_startup_acmd41_polls;
+static unsigned long sd_startup_timerawl;
+
+void sd_startup_begin(void) {
+    sd_startup_timerawl = timer_hw->timerawl;
+    for (size_t istage = 0; istage < SD_STARTUP_STAGES; istage++)
+        sd_startup_us[istage] = 0;
+    sd_startup_cmd0_tries = 0;
+    sd_startup_acmd41_polls = 0;
+}
+
+void sd_startup_mark(const enum sd_startup_stage stage) {
+    /* a stage that took no time at all still reads as reached */
+    if (!sd_startup_us[stage]) sd_startup_us[stage] = (timer_hw->timerawl - sd_startup_timerawl) | 1U;
+}
+
 static void cs_low(void) {
-    gpio_put(15, 0);
+    gpio_put(pin_cs, 0);
 }
 
 static void cs_high(void) {
-    gpio_put(15, 1);
+    gpio_put(pin_cs, 1);
 }
 
 static uint8_t spi_receive_one_byte_with_rx_enabled(void) {
     uint8_t ret = 0;
-    spi_read_blocking(spi1, 0xFF, &ret, 1);
+    spi_read_blocking(card_spi, 0xFF, &ret, 1);
     return ret;
 }
 
@@ -48,25 +122,94 @@ static uint8_t r1_response(void) {
     return result;
 }
 
-static unsigned char crc7_left_shifted(const unsigned char * restrict const message, const size_t length) {
-    const unsigned char polynomial = 0b10001001;
-    unsigned char crc = 0;
+/* extracts a field from a big-endian register such as the csd or scr, given the bit
+ numbers of its msb and lsb as they appear in the sd spec */
+static unsigned long register_bits(const unsigned char * reg, const size_t size, const unsigned msb, const unsigned lsb) {
+    unsigned long ret = 0;
+    for (unsigned ibit = msb + 1; ibit-- > lsb; )
+        ret = ret << 1 | (reg[size - 1 - ibit / 8] >> (ibit % 8) & 1U);
+    return ret;
+}
+
+struct sd_card_info sd_card_info;
+
+/* the sd status may be NULL if it could not be read, in which case those fields are zero */
+static void card_info_from_registers(const uint32_t ocr, const unsigned char cid[16], const unsigned char csd[16],
+                                     const unsigned char scr[8], const unsigned char sd_status[64]) {
+    struct sd_card_info * info = &sd_card_info;
+    *info = (struct sd_card_info) { };
+
+    /* ccs */
+    info->high_capacity = ocr >> 30 & 1U;
+
+    __builtin_memcpy(info->cid, cid, 16);
+    info->manufacturer_id = register_bits(cid, 16, 127, 120);
+    for (size_t ichar = 0; ichar < 2; ichar++)
+        info->oem_id[ichar] = register_bits(cid, 16, 119 - 8 * ichar, 112 - 8 * ichar);
+    for (size_t ichar = 0; ichar < 5; ichar++)
+        info->product_name[ichar] = register_bits(cid, 16, 103 - 8 * ichar, 96 - 8 * ichar);
+    info->product_revision = register_bits(cid, 16, 63, 56);
+    info->serial_number = register_bits(cid, 16, 55, 24);
+    info->manufacture_year = 2000 + register_bits(cid, 16, 19, 12);
+    info->manufacture_month = register_bits(cid, 16, 11, 8);
+
+    /* capacity is encoded differently for standard capacity cards than for the others */
+    const unsigned csd_structure = register_bits(csd, 16, 127, 126);
+    if (0 == csd_structure)
+        info->blocks = (register_bits(csd, 16, 73, 62) + 1ULL) << (register_bits(csd, 16, 49, 47) + 2 +
+                                                                     register_bits(csd, 16, 83, 80) - 9);
+    else
+        info->blocks = (register_bits(csd, 16, 1 == csd_structure ? 69 : 75, 48) + 1ULL) * 1024;
+
+    /* tran_speed, a mantissa in tenths and a power of ten in units of 100 kHz */
+    static const unsigned char tran_speed_tenths[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+    static const unsigned long tran_speed_units[8] = { 10000, 100000, 1000000, 10000000 };
+    info->max_baud_rate = tran_speed_tenths[register_bits(csd, 16, 102, 99)] * tran_speed_units[register_bits(csd, 16, 98, 96)];
+
+    /* ccc, one bit per supported command class */
+    info->command_classes = register_bits(csd, 16, 95, 84);
 
-    for (size_t ibyte = 0; ibyte < length; ibyte++) {
-        crc ^= message[ibyte];
+    /* in both csd versions, erase_blk_en says whether single blocks may be erased, and if
+     not, sector_size is the erase granularity in blocks, minus one */
+    info->erase_blocks = register_bits(csd, 16, 46, 46) ? 1 : register_bits(csd, 16, 45, 39) + 1;
 
-        for (size_t ibit = 0; ibit < 8; ibit++)
-            crc = (crc & 0x80u) ? (crc << 1) ^ (polynomial << 1) : (crc << 1);
+    /* data_stat_after_erase */
+    info->erased_to_zero = !register_bits(scr, 8, 55, 55);
+
+    /* sd_spec, sd_spec3, sd_spec4, and sd_specx together give the major version */
+    const unsigned sd_spec = register_bits(scr, 8, 59, 56), sd_specx = register_bits(scr, 8, 41, 38);
+    info->sd_spec_version = sd_specx ? 4 + sd_specx : register_bits(scr, 8, 42, 42) ? 4 :
+                            register_bits(scr, 8, 47, 47) ? 3 : sd_spec >= 2 ? 2 : 1;
+
+    /* cmd_support bit for cmd23, set_block_count */
+    info->supports_cmd23 = register_bits(scr, 8, 33, 33);
+
+    if (sd_status) {
+        static const unsigned long au_size_blocks[16] = { 0, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192,
+                                                          16384, 24576, 32768, 49152, 65536, 131072 };
+        info->au_blocks = au_size_blocks[register_bits(sd_status, 64, 431, 428)];
+
+        static const unsigned char speed_classes[5] = { 0, 2, 4, 6, 10 };
+        const unsigned speed_class = register_bits(sd_status, 64, 447, 440);
+        info->speed_class = speed_class < 5 ? speed_classes[speed_class] : 0;
+        info->uhs_speed_grade = register_bits(sd_status, 64, 399, 396);
+
+        /* erasing n aus takes erase_timeout / erase_size * n + erase_offset seconds */
+        info->erase_size_aus = register_bits(sd_status, 64, 423, 408);
+        info->erase_timeout_s = register_bits(sd_status, 64, 407, 402);
+        info->erase_offset_s = register_bits(sd_status, 64, 401, 400);
     }
 
-    return crc & 0xfe;
+    if (verbose >= 2)
+        dprintf(2, "%s: %llu blocks, au %lu blocks, erase granularity %lu blocks, erases to %s\r\n", __func__,
+                info->blocks, info->au_blocks, info->erase_blocks, info->erased_to_zero ? "zeros" : "ones");
 }
 
 static void send_command_with_crc7(const uint8_t cmd, const uint32_t arg) {
     unsigned char msg[6] = { cmd | 0x40, arg >> 24, arg >> 16, arg >> 8, arg, 0x01 };
     msg[5] |= crc7_left_shifted(msg, 5);
 
-    spi_write_blocking(spi1, msg, 6);
+    spi_write_blocking(card_spi, msg, 6);
 }
 
 static uint8_t command_and_r1_response(const uint8_t cmd, const uint32_t arg) {
@@ -74,11 +217,56 @@ static uint8_t command_and_r1_response(const uint8_t cmd, const uint32_t arg) {
     return r1_response();
 }
 
-static unsigned int sm, sm_offset;
+/* with the card selected and ready, sends a command whose response is followed by a short
+ data block, such as the csd or scr, and reads and checks that block. the sd status is
+ preceded by an r2 response, which is an r1 followed by another status byte */
+static int spi_read_register(const uint8_t cmd, const uint32_t arg, unsigned char * reg, const size_t len, const int r2) {
+    if (command_and_r1_response(cmd, arg) != 0) return -1;
+    if (r2 && spi_receive_one_byte_with_rx_enabled() != 0) return -1;
+
+    const unsigned long timerawl_start = timer_hw->timerawl;
+    uint8_t token;
+    while (0xFF == (token = spi_receive_one_byte_with_rx_enabled()))
+        if (timer_hw->timerawl - timerawl_start > 100000) return -1;
+    if (0xFE != token) return -1;
+
+    unsigned char crc_received[2];
+    spi_read_blocking(card_spi, 0xFF, reg, len);
+    spi_read_blocking(card_spi, 0xFF, crc_received, 2);
+
+    return crc16(reg, len) == (crc_received[0] << 8 | crc_received[1]) ? 0 : -1;
+}
+
+/* worst-case time spent in each isr, in cpu cycles */
+unsigned long isr_dma_1_cycles_max = 0, isr_pio1_0_cycles_max = 0, isr_pio1_1_cycles_max = 0;
+
+/* whichever state machine most recently raised or will raise a pio interrupt */
+static unsigned int sm;
 static volatile char wait_for_card_ready_nonblocking_must_finish = 0;
 static void (* isr_pio1_0_and_then)(void) = NULL;
 
+/* the wait_for_card_ready program and a state machine to run it stay claimed from the first
+ wait after spi_enable() or sdio_enable() until the matching disable, so that each wait
+ only has to hand the pins to pio, restart the program, and take the pins back */
+static int ready_sm = -1;
+static unsigned ready_offset, ready_baud_rate;
+
+/* time from the start of each wait that could not be satisfied immediately, until the isr
+ that ends it, the minimum of which is the fixed per-wait overhead */
+static unsigned long ready_wait_timerawl;
+size_t card_ready_waits = 0, card_ready_waits_immediate = 0;
+unsigned long card_ready_wake_us_min = ULONG_MAX, card_ready_wake_us_max = 0, card_ready_wake_us_total = 0;
+
+/* only the function select changes, since the pads were already set up for spi */
+static void spi_pins_set_function(const unsigned function) {
+    for (unsigned pin = pin_sck; pin <= pin_miso; pin++)
+        hw_write_masked(&io_bank0_hw->io[pin].ctrl, function << IO_BANK0_GPIO0_CTRL_FUNCSEL_LSB,
+                        IO_BANK0_GPIO0_CTRL_FUNCSEL_BITS);
+}
+
 void isr_pio1_0(void) {
+    const uint32_t cycles_start = DWT->CYCCNT;
+
     /* disable sm BEFORE clearing interrupt so it does not resume executing */
     pio_sm_set_enabled(pio1, sm, false);
 
@@ -87,14 +275,23 @@ void isr_pio1_0(void) {
     irq_clear(PIO_IRQ_NUM(pio1, 0));
     irq_set_enabled(PIO_IRQ_NUM(pio1, 0), false);
 
-    pio_remove_program_and_unclaim_sm(&wait_for_card_ready_program, pio1, sm, sm_offset);
+    /* in 4-bit mode the pins stay with pio, but the cmd line must not be left driven */
+    if (sdio_active)
+        pio_sm_set_consecutive_pindirs(pio1, sm, 11, 1, false);
 
-    clocks_hw->wake_en0 &= ~CLOCKS_WAKE_EN0_CLK_SYS_PIO1_BITS;
-    clocks_hw->sleep_en0 &= ~CLOCKS_SLEEP_EN0_CLK_SYS_PIO1_BITS;
+    if ((int)sm == ready_sm) {
+        const unsigned long elapsed = timer_hw->timerawl - ready_wait_timerawl;
+        card_ready_wake_us_total += elapsed;
+        if (elapsed < card_ready_wake_us_min) card_ready_wake_us_min = elapsed;
+        if (elapsed > card_ready_wake_us_max) card_ready_wake_us_max = elapsed;
+    }
+
+    if (!sdio_active) {
+        clocks_hw->wake_en0 &= ~CLOCKS_WAKE_EN0_CLK_SYS_PIO1_BITS;
+        clocks_hw->sleep_en0 &= ~CLOCKS_SLEEP_EN0_CLK_SYS_PIO1_BITS;
 
-    gpio_set_function(10, GPIO_FUNC_SPI);
-    gpio_set_function(11, GPIO_FUNC_SPI);
-    gpio_set_function(12, GPIO_FUNC_SPI);
+        spi_pins_set_function(GPIO_FUNC_SPI);
+    }
 
     wait_for_card_ready_nonblocking_must_finish = 0;
     __DSB();
@@ -103,62 +300,105 @@ void isr_pio1_0(void) {
     isr_pio1_0_and_then = NULL;
     if (and_then)
         and_then();
+
+    const uint32_t cycles = DWT->CYCCNT - cycles_start;
+    if (cycles > isr_pio1_0_cycles_max) isr_pio1_0_cycles_max = cycles;
 }
 
-static void wait_for_card_ready_nonblocking_start(void) {
-    spi_hw_t * spi_hw = spi_get_hw(spi1);
+static int card_ready_immediately(void) {
+    /* in 4-bit mode, the card holds dat0 low while busy whether or not clk is running */
+    if (sdio_active) {
+        for (size_t iattempt = 0; iattempt < 16; iattempt++)
+            if (gpio_get(12)) return 1;
+        return 0;
+    }
+
+    spi_hw_t * spi_hw = spi_get_hw(card_spi);
 
     /* first try clocking out a few bytes using the spi peripheral */
     for (size_t iattempt = 0; iattempt < 16; iattempt++) {
         while (!(spi_hw->sr & SPI_SSPSR_TNF_BITS));
         spi_hw->dr = 0xFF;
         while (!(spi_hw->sr & SPI_SSPSR_RNE_BITS));
-        if (0xFF == spi_hw->dr) {
-            void (* and_then)(void) = isr_pio1_0_and_then;
-            isr_pio1_0_and_then = NULL;
-            if (and_then)
-                return and_then();
-            else return;
-        }
+        if (0xFF == spi_hw->dr) return 1;
     }
 
+    return 0;
+}
+
+static void ready_engine_load(void) {
+    ready_sm = pio_claim_unused_sm(pio1, true);
+    ready_offset = pio_add_program(pio1, &wait_for_card_ready_program);
+    ready_baud_rate = requested_baud_rate;
+
+    /* in spi mode nothing else touches the pin directions, in 4-bit mode they are set again
+     on every wait */
+    pio_sm_set_consecutive_pindirs(pio1, ready_sm, pin_sck, 2, true);
+    pio_sm_set_consecutive_pindirs(pio1, ready_sm, pin_miso, 1, false);
+
+    pio_sm_config sm_config = wait_for_card_ready_program_get_default_config(ready_offset);
+    sm_config_set_sideset_pins(&sm_config, pin_sck);
+    sm_config_set_jmp_pin(&sm_config, pin_miso);
+    sm_config_set_clkdiv_int_frac8(&sm_config, clock_get_hz(clk_sys) / (2 * requested_baud_rate), 0);
+    pio_sm_init(pio1, ready_sm, ready_offset, &sm_config);
+
+    hw_set_bits(&pio1->input_sync_bypass, 1U << pin_miso);
+}
+
+static void ready_engine_unload(void) {
+    if (-1 == ready_sm) return;
+
+    pio_remove_program_and_unclaim_sm(&wait_for_card_ready_program, pio1, ready_sm, ready_offset);
+    ready_sm = -1;
+}
+
+static void ready_engine_arm(void) {
     wait_for_card_ready_nonblocking_must_finish = 1;
 
+    /* in 4-bit mode these are already enabled and must stay that way */
     clocks_hw->wake_en0 |= CLOCKS_WAKE_EN0_CLK_SYS_PIO1_BITS;
     clocks_hw->sleep_en0 |= CLOCKS_SLEEP_EN0_CLK_SYS_PIO1_BITS;
 
-    sm = pio_claim_unused_sm(pio1, true);
-    sm_offset = pio_add_program(pio1, &wait_for_card_ready_program);
-
-    gpio_set_dir(10, GPIO_OUT);
-    gpio_set_dir(11, GPIO_OUT);
-    gpio_set_dir(12, GPIO_IN);
+    if (-1 == ready_sm) ready_engine_load();
 
-    gpio_put(10, 0);
-    gpio_put(11, 1);
-    gpio_put(12, 0);
-
-    pio_gpio_init(pio1, 10);
-    pio_gpio_init(pio1, 11);
-    pio_gpio_init(pio1, 12);
+    /* the rate controller may have changed the clock since the program was loaded */
+    if (ready_baud_rate != requested_baud_rate) {
+        ready_baud_rate = requested_baud_rate;
+        pio_sm_set_clkdiv_int_frac8(pio1, ready_sm, clock_get_hz(clk_sys) / (2 * requested_baud_rate), 0);
+    }
 
-    pio_sm_set_consecutive_pindirs(pio1, sm, 10, 2, true);
-    pio_sm_set_consecutive_pindirs(pio1, sm, 12, 1, false);
+    sm = ready_sm;
 
-    pio_sm_config sm_config = wait_for_card_ready_program_get_default_config(sm_offset);
-    sm_config_set_sideset_pins(&sm_config, 10);
-    sm_config_set_jmp_pin(&sm_config, 12);
-    sm_config_set_clkdiv_int_frac8(&sm_config, clock_get_hz(clk_sys) / (2 * requested_baud_rate), 0);
-    pio_sm_init(pio1, sm, sm_offset, &sm_config);
+    /* start over from the top, abandoning the irq wait the previous wait ended on */
+    pio_sm_restart(pio1, ready_sm);
+    pio_sm_exec(pio1, ready_sm, pio_encode_jmp(ready_offset));
 
-    hw_set_bits(&pio1->input_sync_bypass, 1U << 12);
-    __DSB();
+    if (sdio_active)
+        pio_sm_set_consecutive_pindirs(pio1, ready_sm, pin_sck, 2, true);
+    else
+        spi_pins_set_function(GPIO_FUNC_PIO1);
 
     pio_set_irq0_source_enabled(pio1, pis_interrupt0, true);
-    pio_interrupt_clear(pio1, sm);
     irq_set_enabled(PIO_IRQ_NUM(pio1, 0), true);
 
-    pio_sm_set_enabled(pio1, sm, true);
+    pio_sm_set_enabled(pio1, ready_sm, true);
+}
+
+static void wait_for_card_ready_nonblocking_start(void) {
+    ready_wait_timerawl = timer_hw->timerawl;
+
+    if (card_ready_immediately()) {
+        card_ready_waits_immediate++;
+
+        void (* and_then)(void) = isr_pio1_0_and_then;
+        isr_pio1_0_and_then = NULL;
+        if (and_then)
+            return and_then();
+        else return;
+    }
+
+    card_ready_waits++;
+    ready_engine_arm();
 }
 
 static void wait_for_card_ready_nonblocking_finish(void) {
@@ -170,53 +410,942 @@ static void wait_for_card_ready(void) {
     wait_for_card_ready_nonblocking_finish();
 }
 
+static int spi_read_app_register(const uint8_t cmd, unsigned char * reg, const size_t len, const int r2) {
+    cs_low();
+    wait_for_card_ready();
+    const uint8_t cmd55_r1_response = command_and_r1_response(55, 0);
+    cs_high();
+
+    if (cmd55_r1_response > 1) return -1;
+
+    cs_low();
+    wait_for_card_ready();
+    const int ret = spi_read_register(cmd, 0, reg, len, r2);
+    cs_high();
+
+    return ret;
+}
+
 static uint32_t spi_receive_uint32be(void) {
     uint32_t ret;
-    spi_read_blocking(spi1, 0xFF, (void *)&ret, 4);
+    spi_read_blocking(card_spi, 0xFF, (void *)&ret, 4);
     return __builtin_bswap32(ret);
 }
 
-void spi_sd_restore_baud_rate(void) {
-    requested_baud_rate = clock_get_hz(clk_peri) / 2U;
+/* if nonzero, spi_disable() and sdio_disable() leave the peripheral clocks, the spi
+ peripheral, the dma channels, and the card-ready program in place, so that a burst of small
+ transfers only pays for setting them up once. spi_sd_session_release() gives them back, and
+ is expected to be called once nothing has used them for a while */
+unsigned char sd_session_hold = 1;
+
+/* holding is only allowed once init has settled on a mode */
+static unsigned char session_hold_allowed = 0, session_held = 0;
+static unsigned session_baud_rate;
+static unsigned long session_last_timerawl;
+
+/* what the setups and teardowns that did happen cost, how many were avoided, and how long
+ things were held without being used, which together show what holding them is worth */
+size_t sd_session_setups = 0, sd_session_setups_saved = 0;
+unsigned long long sd_session_setup_cycles = 0;
+unsigned long sd_session_idle_us = 0;
+
+static uint dma_tx, dma_tx_crc, dma_rx;
+static unsigned char dma_channels_claimed = 0;
+
+static void dma_channels_claim(void) {
+    if (dma_channels_claimed) return;
+
+    const uint32_t cycles_start = DWT->CYCCNT;
+    dma_tx = dma_claim_unused_channel(true);
+    dma_tx_crc = dma_claim_unused_channel(true);
+    dma_rx = dma_claim_unused_channel(true);
+    dma_channels_claimed = 1;
+    sd_session_setup_cycles += DWT->CYCCNT - cycles_start;
+}
+
+static void dma_channels_unclaim(void) {
+    if (!dma_channels_claimed) return;
+
+    dma_channel_unclaim(dma_rx);
+    dma_channel_unclaim(dma_tx_crc);
+    dma_channel_unclaim(dma_tx);
+    dma_channels_claimed = 0;
+}
+
+/* returns nonzero if whatever is still held from earlier can be used as is */
+static int session_resume(const unsigned baud) {
+    if (!session_held) return 0;
+
+    session_held = 0;
+    sd_session_idle_us += timer_hw->timerawl - session_last_timerawl;
+    if (baud != session_baud_rate) return 0;
+
+    sd_session_setups_saved++;
+    return 1;
+}
+
+/* returns nonzero if things should be left as they are rather than torn down */
+static int session_suspend(void) {
+    if (!sd_session_hold || !session_hold_allowed) return 0;
+
+    session_held = 1;
+    session_last_timerawl = timer_hw->timerawl;
+    return 1;
 }
 
 static void spi_enable(unsigned baud) {
-    clocks_hw->wake_en1 |= CLOCKS_WAKE_EN1_CLK_SYS_SPI1_BITS | CLOCKS_WAKE_EN1_CLK_PERI_SPI1_BITS;
-    clocks_hw->sleep_en1 |= CLOCKS_SLEEP_EN1_CLK_SYS_SPI1_BITS | CLOCKS_SLEEP_EN1_CLK_PERI_SPI1_BITS;
-    spi_init(spi1, baud);
+    if (session_resume(baud)) return;
+
+    const uint32_t cycles_start = DWT->CYCCNT;
+    clocks_hw->wake_en1 |= spi_clock_bits;
+    clocks_hw->sleep_en1 |= spi_clock_bits;
+    spi_init(card_spi, baud);
+    session_baud_rate = baud;
+    sd_session_setups++;
+    sd_session_setup_cycles += DWT->CYCCNT - cycles_start;
+}
+
+static void read_engine_unload(void);
+static void write_engine_load(void);
+static void write_engine_unload(void);
+
+static void spi_release(void) {
+    const uint32_t cycles_start = DWT->CYCCNT;
+    ready_engine_unload();
+    spi_deinit(card_spi);
+    clocks_hw->wake_en1 &= ~spi_clock_bits;
+    clocks_hw->sleep_en1 &= ~spi_clock_bits;
+    dma_channels_unclaim();
+    sd_session_setup_cycles += DWT->CYCCNT - cycles_start;
 }
 
 static void spi_disable(void) {
-    spi_deinit(spi1);
-    clocks_hw->wake_en1 &= ~(CLOCKS_WAKE_EN1_CLK_SYS_SPI1_BITS | CLOCKS_WAKE_EN1_CLK_PERI_SPI1_BITS);
-    clocks_hw->sleep_en1 &= ~(CLOCKS_SLEEP_EN1_CLK_SYS_SPI1_BITS | CLOCKS_SLEEP_EN1_CLK_PERI_SPI1_BITS);
+    /* these own the pins while loaded, and always give them back */
+    read_engine_unload();
+    write_engine_unload();
+
+    if (!session_suspend()) spi_release();
+}
+
+static unsigned long microseconds_in_wait_prior = 0;
+static unsigned long microseconds_in_data_prior = 0;
+
+/* 4-bit sd bus mode, in which pins 10-15 are clk, cmd, dat0, dat1, dat2, dat3. the three
+ state machines below stay claimed and their programs stay loaded while in 4-bit mode, and
+ together with wait_for_card_ready they fill the pio instruction memory */
+static unsigned sdio_sm_cmd, sdio_sm_tx, sdio_sm_rx;
+static unsigned sdio_offset_cmd, sdio_offset_tx, sdio_offset_rx;
+static unsigned char sdio_programs_loaded = 0;
+static uint32_t sdio_rca = 0;
+
+/* r1 card status bits that indicate an error, as opposed to state or informational bits */
+#define SDIO_R1_ERRORS 0xFDF98008U
+
+static void sdio_sm_reset(const unsigned this_sm, const unsigned offset) {
+    pio_sm_set_enabled(pio1, this_sm, false);
+    pio_sm_clear_fifos(pio1, this_sm);
+    pio_sm_restart(pio1, this_sm);
+
+    /* leave the osr empty so that the first out instruction autopulls, and keep clk high */
+    pio_sm_exec(pio1, this_sm, pio_encode_mov(pio_osr, pio_null) | pio_encode_sideset(1, 1));
+    pio_sm_exec(pio1, this_sm, pio_encode_out(pio_null, 32) | pio_encode_sideset(1, 1));
+    pio_sm_exec(pio1, this_sm, pio_encode_jmp(offset) | pio_encode_sideset(1, 1));
+}
+
+/* enables exactly the given state machines, since all of them drive clk */
+static void sdio_select_sms(const uint32_t mask) {
+    hw_write_masked(&pio1->ctrl, mask, (1U << sdio_sm_cmd) | (1U << sdio_sm_tx) | (1U << sdio_sm_rx));
+}
+
+/* four pio cycles per sd clock cycle */
+static unsigned sdio_max_baud_rate(void) {
+    return clock_get_hz(clk_sys) / 4U;
+}
+
+static void sdio_enable(void) {
+    if (session_resume(requested_baud_rate)) return;
+
+    const uint32_t cycles_start = DWT->CYCCNT;
+    clocks_hw->wake_en0 |= CLOCKS_WAKE_EN0_CLK_SYS_PIO1_BITS;
+    clocks_hw->sleep_en0 |= CLOCKS_SLEEP_EN0_CLK_SYS_PIO1_BITS;
+
+    const unsigned clkdiv = (clock_get_hz(clk_sys) + 4U * requested_baud_rate - 1U) / (4U * requested_baud_rate);
+    for (size_t ism = 0; ism < 3; ism++) {
+        const unsigned this_sm = (unsigned[3]) { sdio_sm_cmd, sdio_sm_tx, sdio_sm_rx }[ism];
+        pio_sm_set_clkdiv_int_frac8(pio1, this_sm, clkdiv ? clkdiv : 1, 0);
+        pio_sm_clkdiv_restart(pio1, this_sm);
+    }
+
+    session_baud_rate = requested_baud_rate;
+    sd_session_setups++;
+    sd_session_setup_cycles += DWT->CYCCNT - cycles_start;
+}
+
+static void sdio_release(void) {
+    const uint32_t cycles_start = DWT->CYCCNT;
+    ready_engine_unload();
+    clocks_hw->wake_en0 &= ~CLOCKS_WAKE_EN0_CLK_SYS_PIO1_BITS;
+    clocks_hw->sleep_en0 &= ~CLOCKS_SLEEP_EN0_CLK_SYS_PIO1_BITS;
+    dma_channels_unclaim();
+    sd_session_setup_cycles += DWT->CYCCNT - cycles_start;
+}
+
+static void sdio_disable(void) {
+    sdio_select_sms(0);
+
+    if (!session_suspend()) sdio_release();
+}
+
+static void sdio_load_programs(void) {
+    if (sdio_programs_loaded) return;
+
+    sdio_sm_cmd = pio_claim_unused_sm(pio1, true);
+    sdio_sm_tx = pio_claim_unused_sm(pio1, true);
+    sdio_sm_rx = pio_claim_unused_sm(pio1, true);
+    sdio_offset_cmd = pio_add_program(pio1, &sdio_cmd_program);
+    sdio_offset_tx = pio_add_program(pio1, &sdio_tx_program);
+    sdio_offset_rx = pio_add_program(pio1, &sdio_rx_program);
+
+    pio_sm_config sm_config = sdio_cmd_program_get_default_config(sdio_offset_cmd);
+    sm_config_set_sideset_pins(&sm_config, 10);
+    sm_config_set_out_pins(&sm_config, 11, 1);
+    sm_config_set_set_pins(&sm_config, 11, 1);
+    sm_config_set_in_pins(&sm_config, 11);
+    sm_config_set_jmp_pin(&sm_config, 11);
+    sm_config_set_out_shift(&sm_config, false, true, 32);
+    sm_config_set_in_shift(&sm_config, false, true, 32);
+    pio_sm_init(pio1, sdio_sm_cmd, sdio_offset_cmd, &sm_config);
+
+    sm_config = sdio_tx_program_get_default_config(sdio_offset_tx);
+    sm_config_set_sideset_pins(&sm_config, 10);
+    sm_config_set_out_pins(&sm_config, 12, 4);
+    sm_config_set_set_pins(&sm_config, 12, 4);
+    sm_config_set_out_shift(&sm_config, false, true, 32);
+    sm_config_set_in_shift(&sm_config, false, true, 32);
+    pio_sm_init(pio1, sdio_sm_tx, sdio_offset_tx, &sm_config);
+
+    sm_config = sdio_rx_program_get_default_config(sdio_offset_rx);
+    sm_config_set_sideset_pins(&sm_config, 10);
+    sm_config_set_in_pins(&sm_config, 12);
+    sm_config_set_jmp_pin(&sm_config, 12);
+    sm_config_set_out_shift(&sm_config, false, true, 32);
+    sm_config_set_in_shift(&sm_config, false, true, 32);
+    pio_sm_init(pio1, sdio_sm_rx, sdio_offset_rx, &sm_config);
+
+    sdio_sm_reset(sdio_sm_cmd, sdio_offset_cmd);
+    sdio_sm_reset(sdio_sm_tx, sdio_offset_tx);
+    sdio_sm_reset(sdio_sm_rx, sdio_offset_rx);
+
+    sdio_programs_loaded = 1;
+}
+
+/* gives the instruction memory back to the programs used in spi mode */
+static void sdio_unload_programs(void) {
+    if (!sdio_programs_loaded) return;
+
+    pio_remove_program_and_unclaim_sm(&sdio_cmd_program, pio1, sdio_sm_cmd, sdio_offset_cmd);
+    pio_remove_program_and_unclaim_sm(&sdio_tx_program, pio1, sdio_sm_tx, sdio_offset_tx);
+    pio_remove_program_and_unclaim_sm(&sdio_rx_program, pio1, sdio_sm_rx, sdio_offset_rx);
+
+    sdio_programs_loaded = 0;
+}
+
+static void sdio_claim_pins(void) {
+    /* clk is always driven, everything else is bidirectional with pullups */
+    pio_sm_set_pins_with_mask(pio1, sdio_sm_cmd, 0x3FU << 10, 0x3FU << 10);
+    pio_sm_set_consecutive_pindirs(pio1, sdio_sm_cmd, 10, 1, true);
+    pio_sm_set_consecutive_pindirs(pio1, sdio_sm_cmd, 11, 5, false);
+
+    for (unsigned pin = 10; pin < 16; pin++) {
+        if (pin > 10) gpio_pull_up(pin);
+        pio_gpio_init(pio1, pin);
+    }
+
+    /* the two cycle input synchronizer would otherwise cause sampling at the falling edge */
+    hw_set_bits(&pio1->input_sync_bypass, 0x3EU << 10);
+}
+
+/* sends one 48-bit frame preceded by 16 idle bits, which also satisfy the 8 clock cycles
+ the card requires between commands, and then receives the given number of response bits
+ following the start bit, returning -1 if the card did not respond in time */
+static int sdio_transact(const uint32_t hi, const uint32_t lo, const unsigned response_bits, uint32_t * words) {
+    sdio_select_sms(1U << sdio_sm_cmd);
+
+    pio_sm_put(pio1, sdio_sm_cmd, 63);
+    pio_sm_put(pio1, sdio_sm_cmd, hi);
+    pio_sm_put(pio1, sdio_sm_cmd, lo);
+    pio_sm_put(pio1, sdio_sm_cmd, response_bits ? response_bits - 2 : 0);
+
+    const size_t words_expected = response_bits ? (response_bits - 2) / 32 + 1 : 1;
+    const unsigned long timerawl_start = timer_hw->timerawl;
+
+    for (size_t iword = 0; iword < words_expected; iword++) {
+        while (pio_sm_is_rx_fifo_empty(pio1, sdio_sm_cmd))
+            if (timer_hw->timerawl - timerawl_start > 10000) {
+                sdio_sm_reset(sdio_sm_cmd, sdio_offset_cmd);
+                return -1;
+            }
+
+        const uint32_t word = pio_sm_get(pio1, sdio_sm_cmd);
+        if (words) words[iword] = word;
+    }
+
+    return 0;
+}
+
+static int sdio_command(const uint8_t cmd, const uint32_t arg, const unsigned response_bits, uint32_t * words) {
+    uint32_t frame[2];
+    sdio_command_frame(cmd, arg, frame);
+    return sdio_transact(frame[0], frame[1], response_bits, words);
+}
+
+/* sends a command with a 48-bit response, and returns the 32 bit payload of the response */
+static int sdio_command_short(const uint8_t cmd, const uint32_t arg, uint32_t * payload) {
+    uint32_t words[2];
+    if (-1 == sdio_command(cmd, arg, 48, words)) return -1;
+
+    if (-1 == sdio_response_short(cmd, words, payload)) {
+        dprintf(2, "%s: bad response to cmd%u\r\n", __func__, cmd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* sends a command with an r1 response and returns -1 if the card reports an error */
+static int sdio_command_r1(const uint8_t cmd, const uint32_t arg) {
+    uint32_t status;
+    return (-1 == sdio_command_short(cmd, arg, &status) || (status & SDIO_R1_ERRORS)) ? -1 : 0;
+}
+
+/* sends a command with a 136-bit response, and returns the 16 byte register it contains */
+static int sdio_command_long(const uint8_t cmd, const uint32_t arg, unsigned char reg[16]) {
+    uint32_t words[5];
+    if (-1 == sdio_command(cmd, arg, 136, words)) return -1;
+    return sdio_response_long(words, reg);
+}
+
+/* sends a command whose response is followed by a short data block on the dat lines, such
+ as the scr or the cmd6 switch status, and reads and checks that block */
+static int sdio_read_register(const uint8_t cmd, const uint32_t arg, unsigned char * reg, const size_t len) {
+    if (-1 == sdio_command_r1(cmd, arg)) return -1;
+
+    sdio_select_sms(1U << sdio_sm_rx);
+    pio_sm_put(pio1, sdio_sm_rx, 2 * len + 16 - 1);
+
+    /* data, followed by the crc of each line as nibbles */
+    uint32_t words[64 / 4 + 2];
+    const unsigned long timerawl_start = timer_hw->timerawl;
+
+    for (size_t iword = 0; iword < len / 4 + 2; iword++) {
+        while (pio_sm_is_rx_fifo_empty(pio1, sdio_sm_rx))
+            if (timer_hw->timerawl - timerawl_start > 100000) {
+                sdio_sm_reset(sdio_sm_rx, sdio_offset_rx);
+                sdio_select_sms(0);
+                return -1;
+            }
+
+        words[iword] = pio_sm_get(pio1, sdio_sm_rx);
+    }
+
+    sdio_select_sms(0);
+
+    for (size_t ibyte = 0; ibyte < len; ibyte++)
+        reg[ibyte] = words[ibyte / 4] >> (24 - 8 * (ibyte % 4));
+
+    const uint64_t crc = (uint64_t)words[len / 4] << 32 | words[len / 4 + 1];
+    return crc == sdio_crc16_4bit(reg, len / 4) ? 0 : -1;
+}
+
+static int sdio_read_app_register(const uint8_t cmd, unsigned char * reg, const size_t len) {
+    if (-1 == sdio_command_r1(55, sdio_rca)) return -1;
+    return sdio_read_register(cmd, 0, reg, len);
+}
+
+static int sdio_init(void) {
+    requested_baud_rate = 400000;
+
+    sdio_load_programs();
+    sdio_active = 1;
+    sdio_enable();
+    sdio_claim_pins();
+
+    do {
+        /* at least 74 cycles with cmd high */
+        sdio_transact(0xFFFFFFFF, 0xFFFFFFFF, 0, NULL);
+        sdio_transact(0xFFFFFFFF, 0xFFFFFFFF, 0, NULL);
+
+        /* cmd0, software reset, with dat3 pulled high so the card stays in sd bus mode */
+        sdio_command(0, 0, 0, NULL);
+        sd_startup_cmd0_tries++;
+        sd_startup_mark(SD_STARTUP_CMD0);
+
+        /* cmd8, check voltage range and test pattern */
+        uint32_t response;
+        if (-1 == sdio_command_short(8, 0x1AA, &response) || (response & 0xFFF) != 0x1AA) break;
+
+        sd_startup_mark(SD_STARTUP_CMD8);
+        if (verbose >= 2)
+            dprintf(2, "%s: cmd8 success\r\n", __func__);
+
+        /* cmd55, then acmd41 with hcs and full voltage window, until card reports not busy */
+        const unsigned long acmd41_timerawl = timer_hw->timerawl;
+        while (1) {
+            sd_startup_acmd41_polls++;
+            if (-1 == sdio_command_r1(55, 0) ||
+                -1 == sdio_command_short(41, 0x40FF8000, &response)) break;
+            if (response & (1U << 31)) break;
+            if (timer_hw->timerawl - acmd41_timerawl > ACMD41_TIMEOUT_US) break;
+
+            /* sleep or let other stuff run until it is worth asking again */
+            sleep_us_with_yield(sd_startup_fast ? ACMD41_POLL_US_FAST : ACMD41_POLL_US);
+        }
+        if (!(response & (1U << 31))) break;
+        const uint32_t ocr = response;
+
+        sd_startup_mark(SD_STARTUP_ACMD41);
+        if (verbose >= 2)
+            dprintf(2, "%s: cmd55+acmd41 success\r\n", __func__);
+
+        /* cmd2, get cid, then cmd3, get relative card address */
+        unsigned char cid[16];
+        if (-1 == sdio_command_long(2, 0, cid) ||
+            -1 == sdio_command_short(3, 0, &response)) break;
+        sdio_rca = response & 0xFFFF0000U;
+
+        /* cmd9, get csd, which must happen before the card is selected */
+        unsigned char csd[16];
+        if (-1 == sdio_command_long(9, sdio_rca, csd)) break;
+
+        /* cmd7, select card, which has a busy response */
+        if (-1 == sdio_command_r1(7, sdio_rca)) break;
+        sdio_select_sms(0);
+        wait_for_card_ready();
+
+        /* cmd55, then acmd6, set bus width to 4 */
+        if (-1 == sdio_command_r1(55, sdio_rca) ||
+            -1 == sdio_command_r1(6, 2)) break;
+
+        /* cmd16, set block length to 512 */
+        if (-1 == sdio_command_r1(16, 512)) break;
+
+        /* cmd55, then acmd51, get scr, and cmd55, then acmd13, get sd status */
+        unsigned char scr[8], sd_status[64];
+        if (-1 == sdio_read_app_register(51, scr, 8)) break;
+        const int sd_status_valid = !sd_startup_fast && -1 != sdio_read_app_register(13, sd_status, 64);
+
+        card_info_from_registers(ocr, cid, csd, scr, sd_status_valid ? sd_status : NULL);
+
+        sdio_disable();
+
+        sd_startup_mark(SD_STARTUP_INIT);
+        if (verbose >= 1)
+            dprintf(2, "%s: success\r\n", __func__);
+        return 0;
+    } while (0);
+
+    sdio_disable();
+    sdio_unload_programs();
+    sdio_active = 0;
+
+    if (verbose >= 1)
+        dprintf(2, "%s: falling back to spi mode\r\n", __func__);
+    return -1;
+}
+
+/* moves one block into or out of the given state machine's fifo with dma, sleeping while
+ the dma is in progress. the block may be NULL when writing, in which case zeros are sent */
+static void sdio_dma_block(const unsigned dma, const unsigned this_sm, const int is_tx, void * block) {
+    static const uint32_t zero_word = 0;
+
+    dma_channel_config cfg = dma_channel_get_default_config(dma);
+    channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+    channel_config_set_dreq(&cfg, pio_get_dreq(pio1, this_sm, is_tx));
+    channel_config_set_read_increment(&cfg, is_tx && block);
+    channel_config_set_write_increment(&cfg, !is_tx);
+    channel_config_set_bswap(&cfg, true);
+
+    if (is_tx)
+        dma_channel_configure(dma, &cfg, &pio1->txf[this_sm], block ? block : (void *)&zero_word, 128, false);
+    else
+        dma_channel_configure(dma, &cfg, block, &pio1->rxf[this_sm], 128, false);
+
+    /* since we are using sevonpend, enable the irq source but disable in nvic */
+    dma_channel_acknowledge_irq1(dma);
+    dma_channel_set_irq1_enabled(dma, true);
+    irq_set_enabled(DMA_IRQ_1, false);
+
+    dma_channel_start(dma);
+
+    while (dma_channel_is_busy(dma)) yield();
+
+    dma_channel_acknowledge_irq1(dma);
+    dma_channel_set_irq1_enabled(dma, false);
+    irq_clear(DMA_IRQ_1);
+}
+
+/* takes one word from the given state machine's rx fifo, sleeping rather than spinning until
+ the state machine pushes it */
+static uint32_t sdio_sm_get(const unsigned this_sm) {
+    if (pio_sm_is_rx_fifo_empty(pio1, this_sm)) {
+        /* since we are using sevonpend, enable the irq source but disable in nvic */
+        irq_set_enabled(PIO_IRQ_NUM(pio1, 1), false);
+        pio_set_irq1_source_enabled(pio1, pis_sm0_rx_fifo_not_empty + this_sm, true);
+
+        while (pio_sm_is_rx_fifo_empty(pio1, this_sm)) yield();
+
+        pio_set_irq1_source_enabled(pio1, pis_sm0_rx_fifo_not_empty + this_sm, false);
+        irq_clear(PIO_IRQ_NUM(pio1, 1));
+    }
+
+    return pio_sm_get(pio1, this_sm);
+}
+
+/* blocks the card confirmed receiving or sending correctly during the most recent call to
+ spi_sd_read_some_blocks() or spi_sd_write_some_blocks(), which matters when it fails */
+static unsigned long blocks_done = 0;
+
+/* command which started whatever transfer was most recently in progress */
+static uint8_t transfer_cmd = 0;
+
+unsigned long spi_sd_blocks_done(void) {
+    return blocks_done;
+}
+
+/* blocks written by earlier calls within the current multi-block write, and how many of
+ those the card later said it never programmed */
+static unsigned long write_blocks_prior = 0, blocks_lost = 0;
+
+unsigned long spi_sd_blocks_lost(void) {
+    return blocks_lost;
+}
+
+/* acmd22 returns how many blocks of the whole multi-block write were actually programmed,
+ which can be fewer than were accepted, so that is what is used when it can be read */
+static void blocks_done_from_acmd22(const int ret, const unsigned char written_be[4], const unsigned long blocks) {
+    if (-1 == ret) return;
+
+    const unsigned long written = (unsigned long)written_be[0] << 24 | written_be[1] << 16 | written_be[2] << 8 | written_be[3];
+    if (written < write_blocks_prior) {
+        blocks_lost = write_blocks_prior - written;
+        dprintf(2, "%s: card lost %lu blocks from earlier in this write\r\n", __func__, blocks_lost);
+    }
+
+    const unsigned long written_now = written > write_blocks_prior ? written - write_blocks_prior : 0;
+    blocks_done = written_now < blocks ? written_now : blocks;
+}
+
+static int sdio_stop_transmission(void) {
+    const int ret = sdio_command_r1(12, 0);
+    sdio_select_sms(0);
+    wait_for_card_ready();
+    return ret;
+}
+
+static unsigned char sdio_read_multiple;
+
+static int sdio_read_blocks_start(const uint8_t cmd, unsigned long long block_address) {
+    sdio_enable();
+    wait_for_card_ready();
+
+    /* send cmd17 or cmd18 */
+    if (-1 == sdio_command_r1(cmd, block_address)) {
+        sdio_disable();
+        dprintf(2, "%s(%d): fail\r\n", __func__, __LINE__);
+        return -1;
+    }
+
+    sdio_read_multiple = 18 == cmd;
+    transfer_cmd = cmd;
+    dma_channels_claim();
+    return 0;
+}
+
+static void sdio_read_blocks_end(void) {
+
+    /* if we sent cmd18, send cmd12 to stop */
+    if (sdio_read_multiple) sdio_stop_transmission();
+
+    sdio_disable();
+}
+
+static int sdio_read_some_blocks(void * buf, unsigned long blocks) {
+    sdio_select_sms(1U << sdio_sm_rx);
+    blocks_done = 0;
+
+    /* dma needs word alignment, which callers of f_read do not necessarily provide */
+    static uint32_t bounce[128];
+
+    for (size_t iblock = 0; iblock < blocks; iblock++) {
+        unsigned char * block = ((unsigned char *)buf) + 512 * iblock;
+        const int aligned = !((uintptr_t)block & 3);
+
+        /* data and crc of each line, as nibbles, after which the card waits for more clocks */
+        pio_sm_put(pio1, sdio_sm_rx, 1024 + 16 - 1);
+        sdio_dma_block(dma_rx, sdio_sm_rx, 0, aligned ? (void *)block : (void *)bounce);
+        if (!aligned) __builtin_memcpy(block, bounce, 512);
+
+        const uint64_t crc_received = (uint64_t)sdio_sm_get(sdio_sm_rx) << 32;
+        const uint64_t crc = crc_received | sdio_sm_get(sdio_sm_rx);
+
+        if (crc != sdio_crc16_4bit(block, 128)) {
+            dprintf(2, "%s: bad crc\r\n", __func__);
+            sdio_read_blocks_end();
+            return -1;
+        }
+
+        blocks_done++;
+    }
+
+    return 0;
+}
+
+static int sdio_read_blocks(void * buf, unsigned long blocks, unsigned long long block_address) {
+    if (-1 == sdio_read_blocks_start(blocks > 1 ? 18 : 17, block_address) ||
+        -1 == sdio_read_some_blocks(buf, blocks))
+        return -1;
+
+    sdio_read_blocks_end();
+    return 0;
+}
+
+static int sdio_write_blocks_start(unsigned long long block_address) {
+    sdio_enable();
+    wait_for_card_ready();
+
+    if (-1 == sdio_command_r1(25, block_address)) {
+        sdio_disable();
+        return -1;
+    }
+
+    transfer_cmd = 25;
+    microseconds_in_wait_prior = microseconds_in_wait;
+    microseconds_in_data_prior = microseconds_in_data;
+    return 0;
+}
+
+static int sdio_write_some_blocks(const void * buf, const unsigned long blocks) {
+    dma_channels_claim();
+    blocks_done = 0;
+    static uint32_t bounce[128];
+
+    const unsigned char * block = buf;
+    uint64_t crc = sdio_crc16_4bit(block, 128);
+
+    int ret = 0;
+    for (size_t iblock = 0; iblock < blocks; iblock++) {
+        const unsigned char * next_block = block ? block + 512 : NULL;
+
+        if (block && ((uintptr_t)block & 3)) {
+            __builtin_memcpy(bounce, block, 512);
+            block = (void *)bounce;
+        }
+
+        const unsigned long timerawl_before_data = timer_hw->timerawl;
+
+        sdio_select_sms(1U << sdio_sm_tx);
+        pio_sm_put(pio1, sdio_sm_tx, 1024 + 16 - 1);
+        sdio_dma_block(dma_tx, sdio_sm_tx, 1, (void *)block);
+        pio_sm_put_blocking(pio1, sdio_sm_tx, crc >> 32);
+        pio_sm_put_blocking(pio1, sdio_sm_tx, crc);
+
+        /* compute the crc of the next block while this one is going out */
+        if (iblock + 1 < blocks) crc = sdio_crc16_4bit(next_block, 128);
+
+        (void)sdio_sm_get(sdio_sm_tx);
+
+        /* crc status token is a start bit, three status bits, and an end bit, on dat0 */
+        sdio_select_sms(1U << sdio_sm_rx);
+        pio_sm_put(pio1, sdio_sm_rx, 7);
+        const uint32_t token = sdio_sm_get(sdio_sm_rx);
+        const unsigned status = (token >> 26 & 0b100) | (token >> 23 & 0b10) | (token >> 20 & 0b1);
+        sdio_select_sms(0);
+
+        const unsigned long timerawl_before_wait = timer_hw->timerawl;
+        microseconds_in_data += timerawl_before_wait - timerawl_before_data;
+
+        wait_for_card_ready();
+        microseconds_in_wait += timer_hw->timerawl - timerawl_before_wait;
+
+        if (0b010 != status) {
+            if (0b101 == status)
+                dprintf(2, "%s: bad crc\r\n", __func__);
+            else
+                dprintf(2, "%s: error 0x%x\r\n", __func__, status);
+            ret = -1;
+            break;
+        }
+
+        blocks_done = iblock + 1;
+        block = next_block;
+    }
+
+
+    if (-1 == ret) {
+        sdio_stop_transmission();
+
+        unsigned char written[4];
+        blocks_done_from_acmd22(sdio_read_app_register(22, written, 4), written, blocks);
+
+        sdio_disable();
+        transfer_cmd = 0;
+    }
+    else write_blocks_prior += blocks;
+
+    return ret;
+}
+
+static void sdio_write_blocks_end(void) {
+    sdio_stop_transmission();
+    sdio_disable();
+
+    if (verbose >= 1)
+        dprintf(2, "%s: %lu us in data, %lu us in wait\r\n", __func__,
+                (unsigned long)(microseconds_in_data - microseconds_in_data_prior),
+                (unsigned long)(microseconds_in_wait - microseconds_in_wait_prior));
+}
+
+static int sdio_erase_blocks(unsigned long long first, unsigned long long last) {
+    sdio_enable();
+    wait_for_card_ready();
+
+    /* cmd32 and cmd33 set the range, and cmd38 erases it, with a busy response */
+    const int ret = (-1 == sdio_command_r1(32, first) ||
+                     -1 == sdio_command_r1(33, last) ||
+                     -1 == sdio_command_r1(38, 0)) ? -1 : 0;
+
+    sdio_select_sms(0);
+    wait_for_card_ready();
+
+    sdio_disable();
+    return ret;
+}
+
+static int sdio_write_pre_erase(unsigned long blocks) {
+    sdio_enable();
+    wait_for_card_ready();
+
+    const int ret = (-1 == sdio_command_r1(55, sdio_rca) || -1 == sdio_command_r1(23, blocks)) ? -1 : 0;
+
+    sdio_disable();
+    return ret;
+}
+
+/* the failure paths have already sent cmd12, so just check that the card is back in the
+ transfer state with nothing else wrong */
+static int sdio_recover(void) {
+    sdio_enable();
+    wait_for_card_ready();
+
+    uint32_t status;
+    const int ret = -1 == sdio_command_short(13, sdio_rca, &status) || (status & SDIO_R1_ERRORS) ||
+                    (status >> 9 & 0xF) != 4 ? -1 : 0;
+
+    sdio_disable();
+    return ret;
+}
+
+/* fastest the host side can go in whichever mode is active */
+static unsigned host_max_baud_rate(void) {
+    return sdio_active ? sdio_max_baud_rate() : clock_get_hz(clk_peri) / 2U;
+}
+
+/* clock from which host_max_baud_rate() is derived, used to tell whether it has changed */
+static unsigned long host_clock_hz(void) {
+    return sdio_active ? clock_get_hz(clk_sys) : clock_get_hz(clk_peri);
+}
+
+/* result of card_negotiate_speed() for the current card, mode, and host clock */
+static unsigned negotiated_baud_rate = 0;
+static unsigned long negotiated_host_clock_hz = 0;
+
+static unsigned full_baud_rate(void) {
+    if (negotiated_baud_rate && host_clock_hz() == negotiated_host_clock_hz)
+        return negotiated_baud_rate;
+
+    /* no faster than default speed mode allows until something has been negotiated */
+    const unsigned baud = host_max_baud_rate();
+    return baud < 25000000U ? baud : 25000000U;
+}
+
+/* whatever the rate controller most recently asked for, reapplied if the clocks change */
+static unsigned requested_reduction = 0;
+
+void spi_sd_restore_baud_rate(void) {
+    requested_reduction = 0;
+    requested_baud_rate = full_baud_rate();
+}
+
+unsigned spi_sd_reduce_baud_rate(unsigned reduction) {
+    requested_reduction = reduction;
+    requested_baud_rate = full_baud_rate() / (1U + reduction);
+    return requested_baud_rate;
+}
+
+void spi_sd_clock_changed(void) {
+    /* whatever is held was set up with dividers for the old clocks */
+    spi_sd_session_release();
+
+    /* this may be called with the card unpowered, so probing waits for the next transfer */
+    requested_baud_rate = full_baud_rate() / (1U + requested_reduction);
+
+    if (verbose >= 1)
+        dprintf(2, "%s: now at %u baud\r\n", __func__, requested_baud_rate);
+}
+
+int spi_sd_session_held(void) {
+    return session_held;
+}
+
+unsigned long spi_sd_session_idle_us(void) {
+    return session_held ? timer_hw->timerawl - session_last_timerawl : 0;
+}
+
+void spi_sd_session_release(void) {
+    if (!session_held) return;
+
+    session_held = 0;
+    sd_session_idle_us += timer_hw->timerawl - session_last_timerawl;
+
+    if (sdio_active) sdio_release();
+    else spi_release();
+}
+
+/* nonzero if the card may still be busy after a multi-block write was ended without
+ waiting for it, so that the other card could be written to in the meantime */
+static unsigned char card_busy_pending = 0;
+
+/* everything learned about each card at init, saved while another card is selected */
+static struct sd_card_slot_state {
+    struct sd_card_info info;
+    unsigned requested_baud_rate, requested_reduction, negotiated_baud_rate;
+    unsigned long negotiated_host_clock_hz;
+    unsigned char sdio_active, session_hold_allowed, card_busy_pending;
+    uint32_t sdio_rca;
+} slot_states[SDCARD_SLOTS];
+
+int spi_sd_select(const unsigned slot) {
+    if (slot >= SDCARD_SLOTS) return -1;
+    if (slot == current_slot) return 0;
+
+    /* whatever is held is set up for the pins of the card being deselected */
+    spi_sd_session_release();
+
+    slot_states[current_slot] = (struct sd_card_slot_state) {
+        .info = sd_card_info,
+        .requested_baud_rate = requested_baud_rate,
+        .requested_reduction = requested_reduction,
+        .negotiated_baud_rate = negotiated_baud_rate,
+        .negotiated_host_clock_hz = negotiated_host_clock_hz,
+        .sdio_active = sdio_active,
+        .session_hold_allowed = session_hold_allowed,
+        .card_busy_pending = card_busy_pending,
+        .sdio_rca = sdio_rca,
+    };
+
+    const struct sd_card_slot_state * state = slot_states + slot;
+    sd_card_info = state->info;
+    requested_baud_rate = state->requested_baud_rate;
+    requested_reduction = state->requested_reduction;
+    negotiated_baud_rate = state->negotiated_baud_rate;
+    negotiated_host_clock_hz = state->negotiated_host_clock_hz;
+    sdio_active = state->sdio_active;
+    session_hold_allowed = state->session_hold_allowed;
+    card_busy_pending = state->card_busy_pending;
+    sdio_rca = state->sdio_rca;
+
+    const struct sd_card_slot * config = sd_card_slots + slot;
+    card_spi = config->spi_index ? spi1 : spi0;
+    pin_sck = config->pin_sck;
+    pin_mosi = config->pin_sck + 1U;
+    pin_miso = config->pin_sck + 2U;
+    pin_cs = config->pin_cs;
+    spi_clock_bits = config->spi_index ?
+        CLOCKS_WAKE_EN1_CLK_SYS_SPI1_BITS | CLOCKS_WAKE_EN1_CLK_PERI_SPI1_BITS :
+        CLOCKS_WAKE_EN1_CLK_SYS_SPI0_BITS | CLOCKS_WAKE_EN1_CLK_PERI_SPI0_BITS;
+
+    current_slot = slot;
+    return 0;
+}
+
+int spi_sd_wait_ready(void) {
+    if (!card_busy_pending) return 0;
+
+    spi_enable(requested_baud_rate);
+    cs_low();
+    wait_for_card_ready();
+    cs_high();
+    spi_disable();
+
+    card_busy_pending = 0;
+    return 0;
+}
+
+static void card_negotiate_speed(void);
+
+/* the rate negotiated at one host clock says nothing about another, so the first transfer
+ after the clocks change negotiates again, which is only a lookup if this card has already
+ been probed at the new clock. until then, full_baud_rate() stays within default speed */
+static void card_renegotiate_if_clock_changed(void) {
+    if (!negotiated_baud_rate || host_clock_hz() == negotiated_host_clock_hz) return;
+
+    const unsigned reduction = requested_reduction;
+    spi_sd_restore_baud_rate();
+    card_negotiate_speed();
+    spi_sd_reduce_baud_rate(reduction);
 }
 
 int spi_sd_init(unsigned baud_rate_reduction) {
+    /* the cycle counter is used to measure isr durations */
+    DCB->DEMCR |= DCB_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    /* whatever was held belongs to the old card and possibly the other mode */
+    spi_sd_session_release();
+    session_hold_allowed = 0;
+
+    /* nothing is known about whatever card is now present until its registers are read */
+    sd_card_info = (struct sd_card_info) { };
+    negotiated_baud_rate = 0;
+    card_busy_pending = 0;
+
+    /* on the first attempt after power-up, try 4-bit mode before falling back to spi mode */
+    /* the pio programs for 4-bit mode and those for spi mode cannot both fit at once, so
+     with more than one card everything is in spi mode */
+    if (SDCARD_4BIT && 1 == SDCARD_SLOTS && !baud_rate_reduction && -1 != sdio_init()) {
+        card_negotiate_speed();
+        session_hold_allowed = 1;
+        return 0;
+    }
+    sdio_unload_programs();
+    sdio_active = 0;
+
     spi_enable(400000);
-    gpio_set_function(10, GPIO_FUNC_SPI);
-    gpio_set_function(11, GPIO_FUNC_SPI);
-    gpio_set_function(12, GPIO_FUNC_SPI);
+    gpio_set_function(pin_sck, GPIO_FUNC_SPI);
+    gpio_set_function(pin_mosi, GPIO_FUNC_SPI);
+    gpio_set_function(pin_miso, GPIO_FUNC_SPI);
 
-    gpio_init(15);
-    gpio_set_dir(15, GPIO_OUT);
+    gpio_init(pin_cs);
+    gpio_set_dir(pin_cs, GPIO_OUT);
     cs_high();
 
     /* clear miso */
     cs_low();
-    spi_write_blocking(spi1, &(uint8_t){ 0xFF }, 1);
+    spi_write_blocking(card_spi, &(uint8_t){ 0xFF }, 1);
     cs_high();
 
     /* and then clock out at least 74 cycles at 100-400 kBd with cs pin held high */
-    spi_write_blocking(spi1, (unsigned char[10]) { [0 ... 9] = 0xFF }, 10);
+    spi_write_blocking(card_spi, (unsigned char[10]) { [0 ... 9] = 0xFF }, 10);
 
-    /* cmd0, software reset. TODO: is looping this even necessary? */
+    /* cmd0, software reset, which a card that is present but was mid-transfer may need more
+     than one try at, and which is paced so that an empty slot is given up on quickly */
     for (size_t ipass = 0;; ipass++) {
         /* if card likely not present, give up */
-        if (ipass > 1024) {
+        if (ipass >= CMD0_TRIES) {
             spi_disable();
             return -1;
         }
+        sd_startup_cmd0_tries++;
         cs_low();
 
         /* send cmd0 */
@@ -225,10 +1354,10 @@ int spi_sd_init(unsigned baud_rate_reduction) {
 
         if (0x01 == cmd0_r1_response) break;
 
-        /* give other stuff a chance to run if we are looping */
-        __SEV(); yield();
+        sleep_us_with_yield(CMD0_POLL_US);
     }
 
+    sd_startup_mark(SD_STARTUP_CMD0);
     if (verbose >= 2)
         dprintf(2, "%s: cmd0 success\r\n", __func__);
 
@@ -244,6 +1373,14 @@ int spi_sd_init(unsigned baud_rate_reduction) {
 
         const uint8_t r1_response = command_and_r1_response(8, 0x1AA);
 
+        /* illegal command means a version 1 card, which no amount of retrying will fix */
+        if (0x05 == r1_response) {
+            cs_high();
+            spi_disable();
+            dprintf(2, "%s: card does not support cmd8\r\n", __func__);
+            return -1;
+        }
+
         if (0x1 != r1_response) {
             cs_high();
             continue;
@@ -255,6 +1392,7 @@ int spi_sd_init(unsigned baud_rate_reduction) {
         if (0x1AA == response) break;
     }
 
+    sd_startup_mark(SD_STARTUP_CMD8);
     if (verbose >= 2)
         dprintf(2, "%s: cmd8 success\r\n", __func__);
 
@@ -272,35 +1410,49 @@ int spi_sd_init(unsigned baud_rate_reduction) {
         dprintf(2, "%s: cmd59 success\r\n", __func__);
 
     /* cmd55, then acmd41, init. must loop this until the response is 0 */
-    for (size_t ipass = 0;; ipass++) {
-        if (ipass > 2500) {
+    const unsigned long acmd41_timerawl = timer_hw->timerawl;
+    while (1) {
+        if (timer_hw->timerawl - acmd41_timerawl > ACMD41_TIMEOUT_US) {
             spi_disable();
             dprintf(2, "%s: giving up\r\n", __func__);
             return -1;
         }
+        sd_startup_acmd41_polls++;
         cs_low();
         wait_for_card_ready();
 
         const uint8_t cmd55_r1_response = command_and_r1_response(55, 0);
         cs_high();
 
-        if (cmd55_r1_response > 1) continue;
+        if (cmd55_r1_response <= 1) {
+            cs_low();
+            wait_for_card_ready();
 
-        cs_low();
-        wait_for_card_ready();
+            const uint8_t acmd41_r1_response = command_and_r1_response(41, 1U << 30);
+            cs_high();
 
-        const uint8_t acmd41_r1_response = command_and_r1_response(41, 1U << 30);
-        cs_high();
+            if (!acmd41_r1_response) break;
 
-        if (!acmd41_r1_response) break;
+            /* anything other than still idle is an error that waiting will not clear */
+            if (acmd41_r1_response != 0x01) {
+                spi_disable();
+                dprintf(2, "%s: acmd41 failed with 0x%02x\r\n", __func__, acmd41_r1_response);
+                return -1;
+            }
+        }
+
+        /* sleep or let other stuff run until it is worth asking again */
+        sleep_us_with_yield(sd_startup_fast ? ACMD41_POLL_US_FAST : ACMD41_POLL_US);
     }
 
+    sd_startup_mark(SD_STARTUP_ACMD41);
     if (verbose >= 2)
         dprintf(2, "%s: cmd55+acmd41 success\r\n", __func__);
 
-    spi_deinit(spi1);
+    spi_deinit(card_spi);
     requested_baud_rate = clock_get_hz(clk_peri) / (2U + baud_rate_reduction);
-    const unsigned actual_baud = spi_init(spi1, requested_baud_rate);
+    if (requested_baud_rate > 25000000U) requested_baud_rate = 25000000U;
+    const unsigned actual_baud = spi_init(card_spi, requested_baud_rate);
     if (verbose >= 1)
         dprintf(2, "%s: baud rate set to %u\r\n", __func__, actual_baud);
 
@@ -311,8 +1463,7 @@ int spi_sd_init(unsigned baud_rate_reduction) {
         wait_for_card_ready();
         if (command_and_r1_response(58, 0) > 1) break;
 
-        const unsigned int ocr = spi_receive_uint32be();
-        (void)ocr;
+        const uint32_t ocr = spi_receive_uint32be();
         cs_high();
 
         /* cmd16, set block length to 512 */
@@ -321,12 +1472,38 @@ int spi_sd_init(unsigned baud_rate_reduction) {
         if (command_and_r1_response(16, 512) > 1) break;
         cs_high();
 
+        /* cmd9, read csd */
+        unsigned char csd[16];
+        cs_low();
+        wait_for_card_ready();
+        if (-1 == spi_read_register(9, 0, csd, 16, 0)) break;
+        cs_high();
+
+        /* cmd10, read cid */
+        unsigned char cid[16];
+        cs_low();
+        wait_for_card_ready();
+        if (-1 == spi_read_register(10, 0, cid, 16, 0)) break;
+        cs_high();
+
+        /* cmd55, then acmd51, read scr, and cmd55, then acmd13, read sd status */
+        unsigned char scr[8], sd_status[64];
+        if (-1 == spi_read_app_register(51, scr, 8, 0)) break;
+        const int sd_status_valid = !sd_startup_fast && -1 != spi_read_app_register(13, sd_status, 64, 1);
+
+        card_info_from_registers(ocr, cid, csd, scr, sd_status_valid ? sd_status : NULL);
+
         /* we get here on overall success of this function */
         cs_high();
         spi_disable();
 
+        sd_startup_mark(SD_STARTUP_INIT);
         if (verbose >= 1)
             dprintf(2, "%s: success\r\n", __func__);
+
+        /* retries at reduced baud rates keep whatever rate they were asked for */
+        if (!baud_rate_reduction) card_negotiate_speed();
+        session_hold_allowed = 1;
         return 0;
     } while(0);
 
@@ -336,10 +1513,13 @@ int spi_sd_init(unsigned baud_rate_reduction) {
     return -1;
 }
 
-static unsigned long microseconds_in_wait_prior = 0;
-static unsigned long microseconds_in_data_prior = 0;
-
 int spi_sd_write_blocks_start(unsigned long long block_address) {
+    card_renegotiate_if_clock_changed();
+    blocks_done = 0;
+    write_blocks_prior = 0;
+    blocks_lost = 0;
+    if (sdio_active) return sdio_write_blocks_start(block_address);
+
     spi_enable(requested_baud_rate);
     cs_low();
     wait_for_card_ready();
@@ -351,8 +1531,11 @@ int spi_sd_write_blocks_start(unsigned long long block_address) {
         return -1;
     }
 
+    transfer_cmd = 25;
     /* extra byte prior to data packet */
-    spi_write_blocking(spi1, (unsigned char[1]) { 0xff }, 1);
+    spi_write_blocking(card_spi, (unsigned char[1]) { 0xff }, 1);
+
+    write_engine_load();
 
     microseconds_in_wait_prior = microseconds_in_wait;
     microseconds_in_data_prior = microseconds_in_data;
@@ -360,10 +1543,18 @@ int spi_sd_write_blocks_start(unsigned long long block_address) {
 }
 
 void spi_sd_write_blocks_end(void) {
+    if (sdio_active) return sdio_write_blocks_end();
+
+    /* hand the pins back to the spi peripheral */
+    write_engine_unload();
+
     /* send stop tran token */
-    spi_write_blocking(spi1, (unsigned char[2]) { 0xfd, 0xff }, 2);
+    spi_write_blocking(card_spi, (unsigned char[2]) { 0xfd, 0xff }, 2);
 
-    wait_for_card_ready();
+    /* with more than one card, the busy period after the last block is left to overlap with
+     whatever the other card is doing, and the next command to this one waits it out */
+    if (SDCARD_SLOTS > 1) card_busy_pending = 1;
+    else wait_for_card_ready();
 
     cs_high();
     spi_disable();
@@ -374,7 +1565,42 @@ void spi_sd_write_blocks_end(void) {
                 (unsigned long)(microseconds_in_wait - microseconds_in_wait_prior));
 }
 
+int spi_sd_erase_blocks(unsigned long long first, unsigned long long last) {
+    if (sdio_active) return sdio_erase_blocks(first, last);
+
+    spi_enable(requested_baud_rate);
+
+    int ret = -1;
+    do {
+        /* cmd32 and cmd33, set first and last block to erase */
+        cs_low();
+        wait_for_card_ready();
+        if (command_and_r1_response(32, first)) break;
+        cs_high();
+
+        cs_low();
+        wait_for_card_ready();
+        if (command_and_r1_response(33, last)) break;
+        cs_high();
+
+        /* cmd38, erase, after which the card holds miso low until done */
+        cs_low();
+        wait_for_card_ready();
+        if (command_and_r1_response(38, 0)) break;
+        wait_for_card_ready();
+
+        ret = 0;
+    } while (0);
+
+    cs_high();
+    spi_disable();
+    return ret;
+}
+
 int spi_sd_write_pre_erase(unsigned long blocks) {
+    card_renegotiate_if_clock_changed();
+    if (sdio_active) return sdio_write_pre_erase(blocks);
+
     spi_enable(requested_baud_rate);
     cs_low();
     wait_for_card_ready();
@@ -399,105 +1625,198 @@ int spi_sd_write_pre_erase(unsigned long blocks) {
 }
 
 /* these are things that were previously on call stacks but need to be shared with isrs */
-static uint dma_tx, dma_rx;
 static dma_channel_config cfg_tx, cfg_rx;
 static const unsigned char * tx_block;
 static size_t tx_blocks_to_start = 0, tx_blocks_to_finish = 0;
-static unsigned long timerawl_before_data, timerawl_before_wait;
 static uint8_t tx_response;
 static uint16_t tx_crc_dma;
+static unsigned char * rx_block;
+static size_t rx_blocks_to_finish = 0;
+static unsigned char rx_error_token;
+static uint16_t rx_crc_received, rx_crc_dma;
+
+/* the spi_read_block program and its state machine are claimed from just after cmd17 or
+ cmd18 until the card is told to stop, and own the pins in between, so that the token hunt
+ and payload of every block need neither the cpu nor a dma channel clocking out ones */
+static int read_sm = -1;
+static unsigned read_offset;
+
+/* an interrupt that nothing is waiting for, such as one arriving late after an engine was
+ unloaded, is acknowledged or masked and otherwise ignored, so that it does not fire forever */
+static void isr_dma_1_unexpected(void) {
+    dma_hw->ints1 = dma_hw->ints1;
+}
 
-static void start_writing_next_block(void) {
-    if (!tx_blocks_to_start) return;
+static void isr_pio1_1_unexpected(void) {
+    irq_set_enabled(PIO_IRQ_NUM(pio1, 1), false);
+}
 
-    while (spi_is_busy(spi1));
+/* whichever of the read or write paths most recently started a dma with irq enabled */
+static void (* isr_dma_1_and_then)(void) = isr_dma_1_unexpected;
 
-    spi_write_blocking(spi1, (unsigned char[1]) { 0xfc }, 1);
-    while (spi_is_busy(spi1));
+void isr_dma_1(void) {
+    const uint32_t cycles_start = DWT->CYCCNT;
 
-    spi_set_format(spi1, 16, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+    isr_dma_1_and_then();
 
-    static const uint16_t zero_word = 0;
-    dma_channel_configure(dma_tx, &cfg_tx, &spi_get_hw(spi1)->dr, tx_block ? tx_block : (void *)&zero_word, 256, false);
-    if (tx_block) tx_block += 512;
-    tx_blocks_to_start--;
+    const uint32_t cycles = DWT->CYCCNT - cycles_start;
+    if (cycles > isr_dma_1_cycles_max) isr_dma_1_cycles_max = cycles;
+}
 
-    dma_channel_set_irq1_enabled(dma_tx, true);
-    irq_set_enabled(DMA_IRQ_1, true);
+/* whichever of the read or write engines most recently enabled an rx fifo not empty irq */
+static void (* isr_pio1_1_and_then)(void) = isr_pio1_1_unexpected;
 
-    /* compute a CCITT16 CRC on the bytes flowing through the rx dma */
-    dma_sniffer_enable(dma_tx, 0x2, true);
-    dma_sniffer_set_byte_swap_enabled(true);
-    dma_sniffer_set_data_accumulator(0);
+void isr_pio1_1(void) {
+    const uint32_t cycles_start = DWT->CYCCNT;
 
-    timerawl_before_data = timer_hw->timerawl;
+    isr_pio1_1_and_then();
 
-    /* start the dma channel */
-    dma_start_channel_mask(1u << dma_tx);
+    const uint32_t cycles = DWT->CYCCNT - cycles_start;
+    if (cycles > isr_pio1_1_cycles_max) isr_pio1_1_cycles_max = cycles;
 }
 
-static void handle_block_wait_finished(void) {
-    microseconds_in_wait += timer_hw->timerawl - timerawl_before_wait;
+/* the spi_write_block program and its state machine are claimed from just after cmd25 until
+ the stop tran token, and own the pins in between. the payload dma chains to a second
+ channel that feeds the sniffed crc in behind it, so that the only per-block cpu work is
+ one short isr that collects the result and queues the next block */
+static int write_sm = -1;
+static unsigned write_offset, write_loop_cycles;
+static unsigned long write_busy_loops;
 
-    if (0b00101 != tx_response)
-        tx_blocks_to_finish = 0;
-    else
-        tx_blocks_to_finish--;
+static void handle_write_result(void);
 
-    __DSB();
+static void write_engine_load(void) {
+    clocks_hw->wake_en0 |= CLOCKS_WAKE_EN0_CLK_SYS_PIO1_BITS;
+    clocks_hw->sleep_en0 |= CLOCKS_SLEEP_EN0_CLK_SYS_PIO1_BITS;
 
-    start_writing_next_block();
+    write_sm = pio_claim_unused_sm(pio1, true);
+    write_offset = pio_add_program(pio1, &spi_write_block_program);
+
+    /* sck low and mosi high before the pins are handed over */
+    pio_sm_set_pins_with_mask(pio1, write_sm, 1U << pin_mosi, 3U << pin_sck);
+    pio_sm_set_consecutive_pindirs(pio1, write_sm, pin_sck, 2, true);
+    pio_sm_set_consecutive_pindirs(pio1, write_sm, pin_miso, 1, false);
+
+    /* two pio cycles per bit, and no faster than requested */
+    const unsigned clkdiv = (clock_get_hz(clk_sys) + 2U * requested_baud_rate - 1U) / (2U * requested_baud_rate);
+    write_loop_cycles = 2U * (clkdiv ? clkdiv : 1);
+
+    pio_sm_config sm_config = spi_write_block_program_get_default_config(write_offset);
+    sm_config_set_sideset_pins(&sm_config, pin_sck);
+    sm_config_set_out_pins(&sm_config, pin_mosi, 1);
+    sm_config_set_set_pins(&sm_config, pin_mosi, 1);
+    sm_config_set_in_pins(&sm_config, pin_miso);
+    sm_config_set_jmp_pin(&sm_config, pin_miso);
+    sm_config_set_out_shift(&sm_config, false, true, 32);
+    sm_config_set_in_shift(&sm_config, false, false, 32);
+    sm_config_set_clkdiv_int_frac8(&sm_config, clkdiv ? clkdiv : 1, 0);
+    pio_sm_init(pio1, write_sm, write_offset, &sm_config);
+
+    hw_set_bits(&pio1->input_sync_bypass, 1U << pin_miso);
+
+    /* the one word per block wakes isr_pio1_1 */
+    isr_pio1_1_and_then = handle_write_result;
+    pio_set_irq1_source_enabled(pio1, pis_sm0_rx_fifo_not_empty + write_sm, true);
+    irq_set_enabled(PIO_IRQ_NUM(pio1, 1), true);
+
+    spi_pins_set_function(GPIO_FUNC_PIO1);
+    pio_sm_set_enabled(pio1, write_sm, true);
 }
 
-void isr_dma_1(void) {
-    /* disable and clear the irq that caused wfe to return due to sevonpend */
-    dma_channel_acknowledge_irq1(dma_tx);
-    dma_channel_set_irq1_enabled(dma_tx, false);
+static void write_engine_unload(void) {
+    if (-1 == write_sm) return;
 
-    /* retrieve the crc that we calculated on the bytes as they came in */
-    tx_crc_dma = dma_sniffer_get_data_accumulator();
+    irq_set_enabled(PIO_IRQ_NUM(pio1, 1), false);
+    pio_set_irq1_source_enabled(pio1, pis_sm0_rx_fifo_not_empty + write_sm, false);
+    isr_pio1_1_and_then = isr_pio1_1_unexpected;
 
-    dma_channel_cleanup(dma_tx);
-    dma_sniffer_disable();
+    pio_sm_set_enabled(pio1, write_sm, false);
+    pio_remove_program_and_unclaim_sm(&spi_write_block_program, pio1, write_sm, write_offset);
+    write_sm = -1;
+
+    spi_pins_set_function(GPIO_FUNC_SPI);
+
+    clocks_hw->wake_en0 &= ~CLOCKS_WAKE_EN0_CLK_SYS_PIO1_BITS;
+    clocks_hw->sleep_en0 &= ~CLOCKS_SLEEP_EN0_CLK_SYS_PIO1_BITS;
+}
 
-    /* wait for the rest of the spi tx fifo to drain, with wfe inhibited because it
-     will not be accompanied by an interrupt that would wake the processor */
-    while (spi_is_busy(spi1));
+static void start_writing_next_block(void) {
+    if (!tx_blocks_to_start) return;
 
-    /* write the calculated crc out to the card so it can validate it */
-    spi_write16_blocking(spi1, &tx_crc_dma, 1);
+    /* three idle bytes and the start block token, preceded by how many bits to send */
+    pio_sm_put(pio1, write_sm, 32 + 4096 - 1);
+    pio_sm_put(pio1, write_sm, 0xFFFFFFFC);
 
-    /* change format back to 8 bit */
-    while (spi_is_busy(spi1));
-    spi_set_format(spi1, 8, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+    static const uint32_t zero_word = 0;
+    dma_channel_configure(dma_tx, &cfg_tx, &pio1->txf[write_sm], tx_block ? tx_block : (void *)&zero_word, 128, false);
+    if (tx_block) tx_block += 512;
+    tx_blocks_to_start--;
 
-    /* read one byte response from card to see if it validated the crc */
-    spi_read_blocking(spi1, 0xff, &tx_response, 1);
+    /* compute a CCITT16 CRC on the bytes flowing through the tx dma */
+    dma_sniffer_enable(dma_tx, 0x2, true);
+    dma_sniffer_set_byte_swap_enabled(true);
+    dma_sniffer_set_data_accumulator(0);
 
-    tx_response &= 0b11111;
+    /* start the dma channel, which triggers the crc channel when it finishes */
+    dma_start_channel_mask(1u << dma_tx);
+}
 
-    timerawl_before_wait = timer_hw->timerawl;
-    microseconds_in_data += timerawl_before_wait - timerawl_before_data;
+static void handle_write_result(void) {
+    /* reading the word is what clears the interrupt */
+    const uint32_t result = pio_sm_get(pio1, write_sm);
+    tx_response = result >> 24 & 0b11111;
+    write_busy_loops += result & 0xFFFFFF;
 
-    isr_pio1_0_and_then = handle_block_wait_finished;
-    wait_for_card_ready_nonblocking_start();
+    if (0b00101 != tx_response)
+        tx_blocks_to_finish = 0;
+    else
+        tx_blocks_to_finish--;
 
     __DSB();
+
+    start_writing_next_block();
 }
 
 int spi_sd_write_some_blocks(const void * buf, const unsigned long blocks) {
-    dma_tx = dma_claim_unused_channel(true);
+    if (sdio_active) return sdio_write_some_blocks(buf, blocks);
+
+    /* dma needs word alignment, which callers of f_write do not necessarily provide */
+    if ((uintptr_t)buf & 3) {
+        static uint32_t bounce[128];
+        for (size_t iblock = 0; iblock < blocks; iblock++) {
+            __builtin_memcpy(bounce, (const unsigned char *)buf + 512 * iblock, 512);
+            if (-1 == spi_sd_write_some_blocks(bounce, 1)) {
+                blocks_done += iblock;
+                return -1;
+            }
+        }
+        blocks_done = blocks;
+        return 0;
+    }
+
+    dma_channels_claim();
 
+    /* words go out msb first, so swap them out of byte order on the way from memory */
     cfg_tx = dma_channel_get_default_config(dma_tx);
-    channel_config_set_transfer_data_size(&cfg_tx, DMA_SIZE_16);
-    channel_config_set_dreq(&cfg_tx, spi_get_dreq(spi1, true));
+    channel_config_set_transfer_data_size(&cfg_tx, DMA_SIZE_32);
+    channel_config_set_dreq(&cfg_tx, pio_get_dreq(pio1, write_sm, true));
     channel_config_set_read_increment(&cfg_tx, buf ? true : false);
     channel_config_set_write_increment(&cfg_tx, false);
     channel_config_set_bswap(&cfg_tx, true);
+    channel_config_set_chain_to(&cfg_tx, dma_tx_crc);
+
+    dma_channel_config cfg_tx_crc = dma_channel_get_default_config(dma_tx_crc);
+    channel_config_set_transfer_data_size(&cfg_tx_crc, DMA_SIZE_32);
+    channel_config_set_dreq(&cfg_tx_crc, pio_get_dreq(pio1, write_sm, true));
+    channel_config_set_read_increment(&cfg_tx_crc, false);
+    channel_config_set_write_increment(&cfg_tx_crc, false);
+    dma_channel_configure(dma_tx_crc, &cfg_tx_crc, &pio1->txf[write_sm], &dma_hw->sniff_data, 1, false);
 
     tx_block = buf;
     tx_blocks_to_start = blocks;
     tx_blocks_to_finish = blocks;
+    write_busy_loops = 0;
+    const unsigned long timerawl_start = timer_hw->timerawl;
 
     start_writing_next_block();
 
@@ -505,7 +1824,18 @@ int spi_sd_write_some_blocks(const void * buf, const unsigned long blocks) {
      or gets and off-nominal tx response and stops */
     while (tx_blocks_to_finish) yield();
 
-    dma_channel_unclaim(dma_tx);
+    tx_crc_dma = dma_sniffer_get_data_accumulator();
+    dma_sniffer_disable();
+
+    /* the program counted its busy iterations, and everything else was data */
+    const unsigned long elapsed = timer_hw->timerawl - timerawl_start;
+    const unsigned long busy_us = (unsigned long)((unsigned long long)write_busy_loops * write_loop_cycles /
+                                                  (clock_get_hz(clk_sys) / 1000000U));
+    microseconds_in_wait += busy_us;
+    microseconds_in_data += elapsed > busy_us ? elapsed - busy_us : 0;
+
+    /* every block that was started was also accepted, except the last one if it failed */
+    blocks_done = blocks - tx_blocks_to_start - (0b00101 != tx_response ? 1 : 0);
 
     if (0b00101 != tx_response) {
         if (0b01011 == tx_response)
@@ -513,11 +1843,21 @@ int spi_sd_write_some_blocks(const void * buf, const unsigned long blocks) {
         else
             dprintf(2, "%s: error 0x%x\r\n", __func__, tx_response);
 
+        /* send stop tran token, so that the card will answer acmd22 once it is ready */
+        write_engine_unload();
+        spi_write_blocking(card_spi, (unsigned char[2]) { 0xfd, 0xff }, 2);
+        wait_for_card_ready();
         cs_high();
+
+        unsigned char written[4];
+        blocks_done_from_acmd22(spi_read_app_register(22, written, 4, 0), written, blocks);
+
         spi_disable();
+        transfer_cmd = 0;
         return -1;
     }
 
+    write_blocks_prior += blocks;
     return 0;
 }
 
@@ -531,127 +1871,433 @@ int spi_sd_write_blocks(const void * buf, const unsigned long blocks, const unsi
     return 0;
 }
 
-int spi_sd_read_blocks(void * buf, unsigned long blocks, unsigned long long block_address) {
+static void read_engine_load(void) {
+    clocks_hw->wake_en0 |= CLOCKS_WAKE_EN0_CLK_SYS_PIO1_BITS;
+    clocks_hw->sleep_en0 |= CLOCKS_SLEEP_EN0_CLK_SYS_PIO1_BITS;
+
+    read_sm = pio_claim_unused_sm(pio1, true);
+    read_offset = pio_add_program(pio1, &spi_read_block_program);
+
+    /* sck low and mosi high before the pins are handed over */
+    pio_sm_set_pins_with_mask(pio1, read_sm, 1U << pin_mosi, 3U << pin_sck);
+    pio_sm_set_consecutive_pindirs(pio1, read_sm, pin_sck, 2, true);
+    pio_sm_set_consecutive_pindirs(pio1, read_sm, pin_miso, 1, false);
+
+    /* two pio cycles per bit, and no faster than requested */
+    const unsigned clkdiv = (clock_get_hz(clk_sys) + 2U * requested_baud_rate - 1U) / (2U * requested_baud_rate);
+
+    pio_sm_config sm_config = spi_read_block_program_get_default_config(read_offset);
+    sm_config_set_sideset_pins(&sm_config, pin_sck);
+    sm_config_set_in_pins(&sm_config, pin_miso);
+    sm_config_set_jmp_pin(&sm_config, pin_miso);
+    sm_config_set_out_shift(&sm_config, false, true, 32);
+    sm_config_set_in_shift(&sm_config, false, true, 32);
+    sm_config_set_clkdiv_int_frac8(&sm_config, clkdiv ? clkdiv : 1, 0);
+    pio_sm_init(pio1, read_sm, read_offset, &sm_config);
+
+    hw_set_bits(&pio1->input_sync_bypass, 1U << pin_miso);
+
+    spi_pins_set_function(GPIO_FUNC_PIO1);
+    pio_sm_set_enabled(pio1, read_sm, true);
+}
+
+static void read_engine_unload(void) {
+    if (-1 == read_sm) return;
+
+    irq_set_enabled(PIO_IRQ_NUM(pio1, 1), false);
+    pio_set_irq1_source_enabled(pio1, pis_sm0_rx_fifo_not_empty + read_sm, false);
+    isr_pio1_1_and_then = isr_pio1_1_unexpected;
+    isr_dma_1_and_then = isr_dma_1_unexpected;
+
+    pio_sm_set_enabled(pio1, read_sm, false);
+    pio_remove_program_and_unclaim_sm(&spi_read_block_program, pio1, read_sm, read_offset);
+    read_sm = -1;
+
+    spi_pins_set_function(GPIO_FUNC_SPI);
+
+    clocks_hw->wake_en0 &= ~CLOCKS_WAKE_EN0_CLK_SYS_PIO1_BITS;
+    clocks_hw->sleep_en0 &= ~CLOCKS_SLEEP_EN0_CLK_SYS_PIO1_BITS;
+}
+
+static void read_block_start(void);
+
+static void handle_read_crc(void) {
+    if (rx_crc_received != rx_crc_dma)
+        rx_blocks_to_finish = 0;
+    else {
+        rx_block += 512;
+        rx_blocks_to_finish--;
+    }
+
+    __DSB();
+
+    /* only look for the next data token if the caller has asked for another block */
+    if (rx_blocks_to_finish)
+        read_block_start();
+}
+
+static void handle_read_crc_arrived(void) {
+    pio_set_irq1_source_enabled(pio1, pis_sm0_rx_fifo_not_empty + read_sm, false);
+    irq_set_enabled(PIO_IRQ_NUM(pio1, 1), false);
+
+    /* reading the word is what clears the interrupt */
+    rx_crc_received = pio_sm_get(pio1, read_sm);
+    handle_read_crc();
+}
+
+static void handle_read_dma_finished(void) {
+    /* disable and clear the irq that caused wfe to return due to sevonpend */
+    dma_channel_acknowledge_irq1(dma_rx);
+    dma_channel_set_irq1_enabled(dma_rx, false);
+
+    /* no error token can arrive now, so stop listening for one */
+    pio_set_irq0_source_enabled(pio1, pis_interrupt0, false);
+    irq_set_enabled(PIO_IRQ_NUM(pio1, 0), false);
+    isr_pio1_0_and_then = NULL;
+
+    /* retrieve the crc that we calculated on the bytes as they came in */
+    rx_crc_dma = dma_sniffer_get_data_accumulator();
+
+    dma_channel_cleanup(dma_rx);
+    dma_sniffer_disable();
+
+    /* the program pushes the crc reported by the sd card as soon as it has clocked it in,
+     sixteen bit times after the last payload word, which at high baud rates has usually
+     already happened. otherwise, rather than spinning here, finish up in isr_pio1_1 */
+    if (pio_sm_is_rx_fifo_empty(pio1, read_sm)) {
+        isr_pio1_1_and_then = handle_read_crc_arrived;
+        pio_set_irq1_source_enabled(pio1, pis_sm0_rx_fifo_not_empty + read_sm, true);
+        irq_set_enabled(PIO_IRQ_NUM(pio1, 1), true);
+        return;
+    }
+
+    rx_crc_received = pio_sm_get(pio1, read_sm);
+    handle_read_crc();
+}
+
+static void handle_read_error_token(void) {
+    /* the isr has already stopped the state machine and given the pins back to spi */
+    dma_channel_set_irq1_enabled(dma_rx, false);
+    dma_channel_abort(dma_rx);
+    dma_sniffer_disable();
+
+    rx_error_token = 1;
+    rx_blocks_to_finish = 0;
+    __DSB();
+}
+
+static void read_block_start(void) {
+    isr_dma_1_and_then = handle_read_dma_finished;
+    dma_channel_configure(dma_rx, &cfg_rx, rx_block, &pio1->rxf[read_sm], 128, false);
+    dma_channel_acknowledge_irq1(dma_rx);
+    dma_channel_set_irq1_enabled(dma_rx, true);
+    irq_set_enabled(DMA_IRQ_1, true);
+
+    /* compute a CCITT16 CRC on the bytes flowing through the rx dma */
+    dma_sniffer_enable(dma_rx, 0x2, true);
+    dma_sniffer_set_byte_swap_enabled(false);
+    dma_sniffer_set_data_accumulator(0);
+
+    dma_start_channel_mask(1u << dma_rx);
+
+    /* an error token ends the program with an interrupt rather than a dma completion */
+    sm = read_sm;
+    isr_pio1_0_and_then = handle_read_error_token;
+    pio_interrupt_clear(pio1, 0);
+    pio_set_irq0_source_enabled(pio1, pis_interrupt0, true);
+    irq_set_enabled(PIO_IRQ_NUM(pio1, 0), true);
+
+    /* payload and crc bits, minus one */
+    pio_sm_put(pio1, read_sm, 8 * (512 + 2) - 1);
+}
+
+static int read_blocks_start(const uint8_t cmd, unsigned long long block_address) {
     spi_enable(requested_baud_rate);
     cs_low();
     wait_for_card_ready();
 
     /* send cmd17 or cmd18 */
-    if (command_and_r1_response(blocks > 1 ? 18 : 17, block_address) != 0) {
+    if (command_and_r1_response(cmd, block_address) != 0) {
         cs_high();
         spi_disable();
         dprintf(2, "%s(%d): fail\r\n", __func__, __LINE__);
         return -1;
     }
 
-    dma_rx = dma_claim_unused_channel(true);
-    dma_tx = dma_claim_unused_channel(true);
+    transfer_cmd = cmd;
 
-    cfg_tx = dma_channel_get_default_config(dma_tx);
-    channel_config_set_transfer_data_size(&cfg_tx, DMA_SIZE_16);
-    channel_config_set_dreq(&cfg_tx, spi_get_dreq(spi1, true));
-    channel_config_set_read_increment(&cfg_tx, false);
+    read_engine_load();
 
+    /* words arrive msb first, so swap them into byte order on the way to memory */
+    dma_channels_claim();
     cfg_rx = dma_channel_get_default_config(dma_rx);
-    channel_config_set_transfer_data_size(&cfg_rx, DMA_SIZE_16);
-    channel_config_set_dreq(&cfg_rx, spi_get_dreq(spi1, false));
+    channel_config_set_transfer_data_size(&cfg_rx, DMA_SIZE_32);
+    channel_config_set_dreq(&cfg_rx, pio_get_dreq(pio1, read_sm, false));
     channel_config_set_read_increment(&cfg_rx, false);
     channel_config_set_write_increment(&cfg_rx, true);
     channel_config_set_bswap(&cfg_rx, true);
 
-    /* clock out the response in 1 + 512 + 2 byte blocks */
-    for (size_t iblock = 0; iblock < blocks; iblock++) {
-        uint8_t result;
-        /* this can loop for a while */
-        while (0xFF == (result = spi_receive_one_byte_with_rx_enabled()));
+    return 0;
+}
 
-        /* when we break out of the above loop, we've read the Data Token byte */
-        if (0xFE != result) {
-            cs_high();
-            spi_disable();
-            dma_channel_unclaim(dma_rx);
-            dma_channel_unclaim(dma_tx);
-            dprintf(2, "%s(%d): fail\r\n", __func__, __LINE__);
-            return -1;
-        }
+static void read_blocks_finish(const int multiple) {
+    /* hand the pins back to the spi peripheral */
+    read_engine_unload();
 
-        spi_set_format(spi1, 16, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+    /* if we sent cmd18, send cmd12 to stop */
+    if (multiple) {
+        send_command_with_crc7(12, 0);
 
-        uint16_t * restrict const block = ((uint16_t *)buf) + 256 * iblock;
+        /* CMD12 wants an extra byte prior to the response */
+        spi_write_blocking(card_spi, (unsigned char[1]) { 0xff }, 1);
 
-        /* there has got to be a better way to do this than clock out bytes */
-        dma_channel_configure(dma_tx, &cfg_tx, &spi_get_hw(spi1)->dr, &(uint16_t) { 0xFFFF }, 256, false);
-        dma_channel_configure(dma_rx, &cfg_rx, block, &spi_get_hw(spi1)->dr, 256, false);
+        (void)r1_response();
+        wait_for_card_ready();
+    }
 
-        dma_channel_acknowledge_irq1(dma_rx);
+    cs_high();
+    spi_disable();
+}
 
-        /* since we are using sevonpend, enable the irq source but disable in nvic */
-        dma_channel_set_irq1_enabled(dma_rx, true);
-        irq_set_enabled(DMA_IRQ_1, false);
+int spi_sd_read_blocks_start(unsigned long long block_address) {
+    card_renegotiate_if_clock_changed();
+    blocks_done = 0;
+    if (sdio_active) return sdio_read_blocks_start(18, block_address);
 
-        /* compute a CCITT16 CRC on the bytes flowing through the rx dma */
-        dma_sniffer_enable(dma_rx, 0x2, true);
-        dma_sniffer_set_byte_swap_enabled(false);
-        dma_sniffer_set_data_accumulator(0);
+    return read_blocks_start(18, block_address);
+}
 
-        /* start both dma channels simultaneously */
-        dma_start_channel_mask((1u << dma_tx) | (1u << dma_rx));
+int spi_sd_read_some_blocks(void * buf, const unsigned long blocks) {
+    if (sdio_active) return sdio_read_some_blocks(buf, blocks);
+
+    /* dma needs word alignment, which callers of f_read do not necessarily provide */
+    if ((uintptr_t)buf & 3) {
+        static uint32_t bounce[128];
+        for (size_t iblock = 0; iblock < blocks; iblock++) {
+            if (-1 == spi_sd_read_some_blocks(bounce, 1)) {
+                blocks_done = iblock;
+                return -1;
+            }
+            __builtin_memcpy((unsigned char *)buf + 512 * iblock, bounce, 512);
+        }
+        blocks_done = blocks;
+        return 0;
+    }
 
-        unsigned wakes = 0;
+    rx_block = buf;
+    rx_blocks_to_finish = blocks;
+    rx_error_token = 0;
+    __DSB();
 
-        /* do other things and then sleep, while waiting for dma to finish */
-        while (dma_channel_is_busy(dma_rx)) {
-            yield();
-            wakes++;
-        }
+    read_block_start();
 
-        /* disable and clear the irq that caused wfe to return due to sevonpend */
-        dma_channel_acknowledge_irq1(dma_rx);
-        dma_channel_set_irq1_enabled(dma_rx, false);
-        irq_clear(DMA_IRQ_1);
+    /* do other things until the chain of isrs and pio and dma has read all the blocks, or
+     gets a bad data token or crc and stops */
+    while (rx_blocks_to_finish) yield();
 
-        /* retrieve the crc that we calculated on the bytes as they came in */
-        const uint16_t crc_dma = dma_sniffer_get_data_accumulator();
+    blocks_done = (rx_block - (unsigned char *)buf) / 512;
 
-        dma_channel_cleanup(dma_rx);
-        dma_channel_cleanup(dma_tx);
-        dma_sniffer_disable();
+    if (rx_block != (unsigned char *)buf + 512 * blocks) {
+        if (rx_error_token)
+            dprintf(2, "%s: error token\r\n", __func__);
+        else
+            dprintf(2, "%s: bad crc (received 0x%04X, dma 0x%04X)\r\n", __func__, rx_crc_received, rx_crc_dma);
 
-        /* read the crc reported by the sd card */
-        uint16_t crc_received;
-        spi_read16_blocking(spi1, 0xFFFF, (void *)&crc_received, 1);
+        read_engine_unload();
+        cs_high();
+        spi_disable();
+        return -1;
+    }
 
-        spi_set_format(spi1, 8, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+    return 0;
+}
 
-        if (verbose >= 2)
-            dprintf(2, "%s: received crc 0x%04X, dma 0x%04X, %u wakes\r\n",
-                    __func__, crc_received, crc_dma, wakes);
+void spi_sd_read_blocks_end(void) {
+    if (sdio_active) return sdio_read_blocks_end();
 
-        if (crc_received != crc_dma) {
-            cs_high();
-            spi_disable();
-            dma_channel_unclaim(dma_rx);
-            dma_channel_unclaim(dma_tx);
-            dprintf(2, "%s: bad crc\r\n", __func__);
-            return -1;
-        }
-    }
+    read_blocks_finish(1);
+}
 
-    /* if we sent cmd18, send cmd12 to stop */
-    if (blocks > 1) {
-        send_command_with_crc7(12, 0);
+int spi_sd_read_blocks(void * buf, unsigned long blocks, unsigned long long block_address) {
+    if (sdio_active) return sdio_read_blocks(buf, blocks, block_address);
 
-        /* CMD12 wants an extra byte prior to the response */
-        spi_write_blocking(spi1, (unsigned char[1]) { 0xff }, 1);
+    if (-1 == read_blocks_start(blocks > 1 ? 18 : 17, block_address) ||
+        -1 == spi_sd_read_some_blocks(buf, blocks))
+        return -1;
+
+    read_blocks_finish(blocks > 1);
 
+    return 0;
+}
+
+int spi_sd_recover(void) {
+    if (sdio_active) return sdio_recover();
+
+    spi_enable(requested_baud_rate);
+    cs_low();
+
+    if (18 == transfer_cmd) {
+        /* the card keeps sending blocks until told to stop */
+        send_command_with_crc7(12, 0);
+        spi_write_blocking(card_spi, (unsigned char[1]) { 0xff }, 1);
         (void)r1_response();
-        wait_for_card_ready();
-    }
+    } else if (25 == transfer_cmd)
+        /* the card may still be waiting for another data packet */
+        spi_write_blocking(card_spi, (unsigned char[2]) { 0xfd, 0xff }, 2);
+
+    transfer_cmd = 0;
+    wait_for_card_ready();
+
+    /* cmd13 has an r2 response in spi mode, both bytes of which are zero if all is well */
+    const uint8_t r1 = command_and_r1_response(13, 0);
+    const uint8_t r2 = spi_receive_one_byte_with_rx_enabled();
 
     cs_high();
     spi_disable();
-    dma_channel_unclaim(dma_rx);
-    dma_channel_unclaim(dma_tx);
+    return r1 || r2 ? -1 : 0;
+}
+
+/* sends cmd6 with the given argument, and returns the 512-bit switch status */
+static int card_switch_function(const uint32_t arg, unsigned char status[64]) {
+    int ret;
+    if (sdio_active) {
+        sdio_enable();
+        wait_for_card_ready();
+        ret = sdio_read_register(6, arg, status, 64);
+        sdio_disable();
+    } else {
+        spi_enable(requested_baud_rate);
+        cs_low();
+        wait_for_card_ready();
+        ret = spi_read_register(6, arg, status, 64, 0);
+        cs_high();
+        spi_disable();
+    }
+    return ret;
+}
+
+static int card_switch_to_high_speed(void) {
+    unsigned char status[64];
+
+    /* check mode, to see whether group 1 (access mode) supports function 1 (high speed) */
+    if (-1 == card_switch_function(0x00FFFFF1, status) || !register_bits(status, 64, 401, 401)) return -1;
+
+    /* switch mode, which succeeded if the card now reports function 1 selected in group 1 */
+    if (-1 == card_switch_function(0x80FFFFF1, status) || register_bits(status, 64, 379, 376) != 1) return -1;
 
     return 0;
 }
+
+/* fastest clock at which each card seen since boot was found to work reliably, along with
+ the mode and host clock at the time, so that later mounts can skip probing */
+static struct negotiated_speed {
+    unsigned char cid[16];
+    unsigned long host_clock_hz;
+    unsigned baud_rate;
+    unsigned char sdio, high_speed;
+} negotiated_speeds[4];
+static size_t negotiated_speeds_next = 0;
+
+size_t card_speed_probes = 0;
+
+/* blocks per probe read, and how many places on the card are read at each candidate rate */
+#define PROBE_BLOCKS 8
+#define PROBE_SPREAD 4
+
+static void card_negotiate_speed(void) {
+    const unsigned long host_hz = host_clock_hz();
+    const unsigned init_baud = requested_baud_rate;
+
+    for (size_t ientry = 0; ientry < sizeof(negotiated_speeds) / sizeof(negotiated_speeds[0]); ientry++) {
+        const struct negotiated_speed * entry = negotiated_speeds + ientry;
+        if (!entry->baud_rate || entry->host_clock_hz != host_hz || entry->sdio != sdio_active ||
+            __builtin_memcmp(entry->cid, sd_card_info.cid, 16)) continue;
+
+        /* the card forgot it was in high speed mode when it was power cycled */
+        if (entry->high_speed && -1 == card_switch_to_high_speed()) break;
+
+        negotiated_baud_rate = entry->baud_rate;
+        negotiated_host_clock_hz = host_hz;
+        spi_sd_restore_baud_rate();
+        sd_card_info.high_speed = entry->high_speed;
+        sd_card_info.baud_rate = entry->baud_rate;
+
+        if (verbose >= 1)
+            dprintf(2, "%s: reusing %u baud for this card\r\n", __func__, negotiated_baud_rate);
+        return;
+    }
+
+    card_speed_probes++;
+
+    /* only switch to high speed mode if the host can go faster than default speed mode
+     allows, since it costs power. command class 10 is required for cmd6 */
+    const unsigned host_max = host_max_baud_rate();
+    const unsigned char high_speed = host_max > 25000000U && (sd_card_info.command_classes & (1U << 10)) &&
+                                     -1 != card_switch_to_high_speed();
+    const unsigned card_max = high_speed ? 50000000U : 25000000U;
+    const unsigned fastest = host_max < card_max ? host_max : card_max;
+
+    /* step down until multi-block reads spread across the card all succeed. each of these
+     checks the crc of every block, so a marginal clock shows up as a failure */
+    __attribute((aligned(4))) static unsigned char probe[PROBE_BLOCKS * 512];
+    const unsigned long long last = sd_card_info.blocks > PROBE_BLOCKS ? sd_card_info.blocks - PROBE_BLOCKS : 0;
+    const unsigned long long probe_addresses[PROBE_SPREAD] = { 0, last / 3, 2 * last / 3, last };
+
+    unsigned baud = 0;
+    for (unsigned divisor = 1; divisor <= 4 && !baud; divisor++) {
+        requested_baud_rate = fastest / divisor;
+
+        size_t iprobe;
+        for (iprobe = 0; iprobe < PROBE_SPREAD; iprobe++)
+            if (-1 == spi_sd_read_blocks(probe, PROBE_BLOCKS, probe_addresses[iprobe])) break;
+
+        if (PROBE_SPREAD == iprobe) {
+            baud = requested_baud_rate;
+            continue;
+        }
+
+        if (verbose >= 1)
+            dprintf(2, "%s: %u baud is not reliable\r\n", __func__, requested_baud_rate);
+
+        /* a failed read can leave the card still sending blocks, and it must be back in the
+         transfer state before the next rate is tried. this is done at the rate init used,
+         since the one that just failed cannot be trusted to deliver cmd12 either */
+        const unsigned failed_baud = requested_baud_rate;
+        requested_baud_rate = init_baud;
+        const int recovered = spi_sd_recover();
+        requested_baud_rate = failed_baud;
+
+        if (-1 == recovered && verbose >= 1)
+            dprintf(2, "%s: card did not recover after %u baud\r\n", __func__, failed_baud);
+    }
+
+    /* if nothing worked, go back to the rate at which init read the registers, and leave
+     nothing behind that would have the next mount of this card skip probing */
+    if (!baud) {
+        negotiated_baud_rate = init_baud;
+        negotiated_host_clock_hz = host_hz;
+        requested_baud_rate = init_baud;
+        sd_card_info.high_speed = high_speed;
+        sd_card_info.baud_rate = init_baud;
+
+        dprintf(2, "%s: no rate up to %u baud was reliable, staying at %u\r\n", __func__, fastest, init_baud);
+        return;
+    }
+
+    negotiated_baud_rate = baud;
+    negotiated_host_clock_hz = host_hz;
+    requested_baud_rate = baud;
+
+    struct negotiated_speed * entry = negotiated_speeds + negotiated_speeds_next;
+    negotiated_speeds_next = (negotiated_speeds_next + 1) % (sizeof(negotiated_speeds) / sizeof(negotiated_speeds[0]));
+    __builtin_memcpy(entry->cid, sd_card_info.cid, 16);
+    entry->host_clock_hz = host_hz;
+    entry->baud_rate = baud;
+    entry->sdio = sdio_active;
+    entry->high_speed = high_speed;
+    sd_card_info.high_speed = high_speed;
+    sd_card_info.baud_rate = baud;
+
+    if (verbose >= 1)
+        dprintf(2, "%s: %s speed mode, %u baud\r\n", __func__, high_speed ? "high" : "default", baud);
+}
@@ -1,3 +1,11 @@
+#pragma once
+
+/* number of card slots, each on its own spi peripheral and pins, of which one at a time is
+ selected, and all others keep their state. can be set to 2 at build time */
+#ifndef SDCARD_SLOTS
+#define SDCARD_SLOTS 1
+#endif
+
 int spi_sd_read_blocks(void * buf, unsigned long blocks, unsigned long long block_address);
 int spi_sd_write_blocks(const void * buf, const unsigned long blocks, const unsigned long long block_address);
 
@@ -9,4 +17,92 @@ int spi_sd_write_blocks_start(unsigned long long block_address);
 int spi_sd_write_some_blocks(const void * buf, const unsigned long blocks);
 void spi_sd_write_blocks_end(void);
 
+int spi_sd_read_blocks_start(unsigned long long block_address);
+int spi_sd_read_some_blocks(void * buf, const unsigned long blocks);
+void spi_sd_read_blocks_end(void);
+
 void spi_sd_restore_baud_rate(void);
+unsigned spi_sd_reduce_baud_rate(unsigned reduction);
+
+/* must be called after clk_sys or clk_peri changes, with no transfer open. the next transfer
+ then negotiates the fastest reliable rate at the new clocks, once per card and clock */
+void spi_sd_clock_changed(void);
+
+/* after a failed transfer, how many blocks made it, and an attempt to get the card back
+ to the transfer state without reinitializing it */
+unsigned long spi_sd_blocks_done(void);
+
+/* after a failed write, how many blocks accepted by earlier calls within the same
+ multi-block write, which returned success, the card then said it never programmed. these
+ are the ones just before wherever that write had gotten to */
+unsigned long spi_sd_blocks_lost(void);
+int spi_sd_recover(void);
+
+/* whether the peripheral, clocks, and dma channels are still held after the most recent
+ transfer, for how long, and giving them back */
+int spi_sd_session_held(void);
+unsigned long spi_sd_session_idle_us(void);
+void spi_sd_session_release(void);
+
+/* selects which card all the above apply to, and must not be called with a transfer open.
+ the other waits for the selected card to finish any busy period left pending by ending a
+ multi-block write, which only happens with more than one card */
+int spi_sd_select(unsigned slot);
+int spi_sd_wait_ready(void);
+
+int spi_sd_erase_blocks(unsigned long long first, unsigned long long last);
+
+/* time from the start of the most recent power-up of the card at which each stage of getting
+ it ready was first reached, or zero if it has not been. the stages after init are marked
+ by the layers above the driver */
+enum sd_startup_stage { SD_STARTUP_POWERED, SD_STARTUP_CMD0, SD_STARTUP_CMD8, SD_STARTUP_ACMD41,
+    SD_STARTUP_INIT, SD_STARTUP_MOUNT, SD_STARTUP_FIRST_WRITE, SD_STARTUP_STAGES };
+
+extern unsigned long sd_startup_us[SD_STARTUP_STAGES];
+extern unsigned sd_startup_cmd0_tries, sd_startup_acmd41_polls;
+
+void sd_startup_begin(void);
+void sd_startup_mark(enum sd_startup_stage stage);
+
+/* if nonzero, the card is polled more often while it powers up, and registers that are not
+ needed to get to the first write are skipped, at some cost in energy while waiting */
+extern unsigned char sd_startup_fast;
+
+/* things learned from the card's registers during init */
+struct sd_card_info {
+    /* from the ocr, nonzero if the card is addressed in blocks rather than bytes */
+    unsigned char high_capacity;
+
+    /* from the cid, which identifies the individual card */
+    unsigned char cid[16];
+    unsigned char manufacturer_id;
+    char oem_id[3], product_name[6];
+    unsigned char product_revision;
+    unsigned long serial_number;
+    unsigned manufacture_year, manufacture_month;
+
+    /* from the csd, capacity in blocks, maximum clock in default speed mode, supported
+     command classes, and granularity of erases in blocks */
+    unsigned long long blocks;
+    unsigned long max_baud_rate;
+    unsigned command_classes;
+    unsigned long erase_blocks;
+
+    /* from the scr, nonzero if erased blocks read back as zeros rather than ones */
+    unsigned char erased_to_zero;
+    unsigned char sd_spec_version;
+    unsigned char supports_cmd23;
+
+    /* from the sd status, if it could be read. au_blocks is the allocation unit size, and
+     the erase parameters are used as in section 4.14 of the simplified physical spec */
+    unsigned long au_blocks;
+    unsigned char speed_class, uhs_speed_grade;
+    unsigned erase_size_aus;
+    unsigned char erase_timeout_s, erase_offset_s;
+
+    /* negotiated after the registers are read, not part of any of them */
+    unsigned char high_speed;
+    unsigned long baud_rate;
+};
+
+extern struct sd_card_info sd_card_info;
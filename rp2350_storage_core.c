@@ -0,0 +1,153 @@
+/* optionally moves the diskio layer and the sd card driver to core1, so that everything on
+ core0, including the task calling into fatfs, keeps running while the card is busy */
+#include "rp2350_storage_core.h"
+#include "spsc_ring.h"
+
+#if STORAGE_ON_CORE1
+/* definitions of datatypes and of the functions being forwarded */
+#include "ff.h"
+#include "diskio.h"
+
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "RP2350.h"
+
+#include <stddef.h>
+
+extern void yield(void);
+
+/* the real implementations, which diskio.c renames when this is enabled */
+extern DSTATUS core1_disk_status(BYTE pdrv);
+extern DSTATUS core1_disk_initialize(BYTE pdrv);
+extern DRESULT core1_disk_read(BYTE pdrv, BYTE * buff, LBA_t sector, UINT count);
+extern DRESULT core1_disk_write(BYTE pdrv, const BYTE * buff, LBA_t sector, UINT count);
+extern DRESULT core1_disk_ioctl(BYTE pdrv, BYTE cmd, void * buff);
+extern void core1_disk_service(void);
+extern void core1_disk_learn_layout(const FATFS * fs);
+extern void core1_disk_release(void);
+
+/* silence compiler warnings about no previous prototype */
+extern void disk_service(void);
+extern void disk_learn_layout(const FATFS * fs);
+extern void disk_release(void);
+
+enum { STORAGE_STATUS, STORAGE_INITIALIZE, STORAGE_READ, STORAGE_WRITE, STORAGE_IOCTL,
+    STORAGE_LEARN_LAYOUT, STORAGE_RELEASE };
+
+struct storage_request {
+    unsigned char op;
+    BYTE pdrv, cmd;
+    void * buff;
+    LBA_t sector;
+    UINT count;
+    const FATFS * fs;
+};
+
+/* core0 produces requests and core1 consumes them */
+#define STORAGE_QUEUE_DEPTH 4
+static struct storage_request storage_queue[STORAGE_QUEUE_DEPTH];
+static struct spsc_ring storage_ring;
+
+size_t storage_requests = 0;
+unsigned long storage_request_us_max = 0;
+
+static unsigned storage_call(const struct storage_request * request) {
+    const unsigned long timerawl_start = timer_hw->timerawl;
+
+    while (spsc_ring_full(&storage_ring, STORAGE_QUEUE_DEPTH))
+        yield();
+
+    storage_queue[spsc_ring_head(&storage_ring, STORAGE_QUEUE_DEPTH)] = *request;
+    spsc_ring_publish(&storage_ring);
+    __SEV();
+
+    /* callers are serialized by the card lock, so there is only ever one request in flight,
+     and the next word in the fifo is the answer to it. core1 sevs when it pushes one */
+    while (!multicore_fifo_rvalid()) yield();
+    const unsigned result = multicore_fifo_pop_blocking();
+
+    storage_requests++;
+    const unsigned long elapsed = timer_hw->timerawl - timerawl_start;
+    if (elapsed > storage_request_us_max) storage_request_us_max = elapsed;
+
+    return result;
+}
+
+static unsigned storage_dispatch(const struct storage_request * request) {
+    switch (request->op) {
+        case STORAGE_STATUS: return core1_disk_status(request->pdrv);
+        case STORAGE_INITIALIZE: return core1_disk_initialize(request->pdrv);
+        case STORAGE_READ: return core1_disk_read(request->pdrv, request->buff, request->sector, request->count);
+        case STORAGE_WRITE: return core1_disk_write(request->pdrv, request->buff, request->sector, request->count);
+        case STORAGE_IOCTL: return core1_disk_ioctl(request->pdrv, request->cmd, request->buff);
+        case STORAGE_LEARN_LAYOUT: core1_disk_learn_layout(request->fs); return 0;
+        case STORAGE_RELEASE: core1_disk_release(); return 0;
+        default: return RES_PARERR;
+    }
+}
+
+static void storage_core1_main(void) {
+    /* the driver waits for interrupts that are enabled in peripherals but not in nvic, and
+     which are therefore only pending on whichever core set them up, which is this one */
+    scb_hw->scr |= M33_SCR_SEVONPEND_BITS;
+
+    while (1) {
+        if (spsc_ring_empty(&storage_ring)) {
+            /* between requests, close or flush or release whatever has come due, which
+             core0 would otherwise do from card_service() */
+            core1_disk_service();
+
+            /* a sev from core0 between the above check and here is not lost */
+            __DSB(); __WFE();
+            continue;
+        }
+
+        const unsigned result = storage_dispatch(storage_queue + spsc_ring_tail(&storage_ring, STORAGE_QUEUE_DEPTH));
+        spsc_ring_release(&storage_ring);
+        multicore_fifo_push_blocking(result);
+    }
+}
+
+void storage_core_init(void) {
+    multicore_launch_core1(storage_core1_main);
+}
+
+DSTATUS disk_status(BYTE pdrv) {
+    return storage_call(&(struct storage_request) { .op = STORAGE_STATUS, .pdrv = pdrv });
+}
+
+DSTATUS disk_initialize(BYTE pdrv) {
+    return storage_call(&(struct storage_request) { .op = STORAGE_INITIALIZE, .pdrv = pdrv });
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE * buff, LBA_t sector, UINT count) {
+    return storage_call(&(struct storage_request) { .op = STORAGE_READ, .pdrv = pdrv,
+        .buff = buff, .sector = sector, .count = count });
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE * buff, LBA_t sector, UINT count) {
+    return storage_call(&(struct storage_request) { .op = STORAGE_WRITE, .pdrv = pdrv,
+        .buff = (void *)buff, .sector = sector, .count = count });
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void * buff) {
+    return storage_call(&(struct storage_request) { .op = STORAGE_IOCTL, .pdrv = pdrv,
+        .cmd = cmd, .buff = buff });
+}
+
+void disk_service(void) {
+    /* core1 does this on its own between requests */
+}
+
+void disk_learn_layout(const FATFS * fs) {
+    storage_call(&(struct storage_request) { .op = STORAGE_LEARN_LAYOUT, .fs = fs });
+}
+
+void disk_release(void) {
+    storage_call(&(struct storage_request) { .op = STORAGE_RELEASE });
+}
+
+#else
+void storage_core_init(void) { }
+#endif
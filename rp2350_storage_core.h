@@ -0,0 +1,10 @@
+#pragma once
+
+/* if nonzero, diskio.c and rp2350_sdcard.c run on core1, and the disk_* functions called
+ by fatfs on core0 forward each request to it through a queue, yielding until it is done */
+#ifndef STORAGE_ON_CORE1
+#define STORAGE_ON_CORE1 0
+#endif
+
+/* launches core1 if the above is enabled, and does nothing otherwise */
+void storage_core_init(void);
@@ -0,0 +1,91 @@
+#pragma once
+
+/* crcs and bit packing of sd commands and responses, which touch no hardware, and so are
+ kept here where they can also be checked on a host. these are static inline because the
+ crcs are on the per-block path of the driver */
+#include <stdint.h>
+#include <stddef.h>
+
+static inline unsigned char crc7_left_shifted(const unsigned char * restrict const message, const size_t length) {
+    const unsigned char polynomial = 0b10001001;
+    unsigned char crc = 0;
+
+    for (size_t ibyte = 0; ibyte < length; ibyte++) {
+        crc ^= message[ibyte];
+
+        for (size_t ibit = 0; ibit < 8; ibit++)
+            crc = (crc & 0x80u) ? (crc << 1) ^ (polynomial << 1) : (crc << 1);
+    }
+
+    return crc & 0xfe;
+}
+
+static inline uint16_t crc16(const unsigned char * restrict const message, const size_t length) {
+    uint16_t crc = 0;
+
+    for (size_t ibyte = 0; ibyte < length; ibyte++) {
+        crc ^= (uint16_t)message[ibyte] << 8;
+
+        for (size_t ibit = 0; ibit < 8; ibit++)
+            crc = (crc & 0x8000u) ? (uint16_t)(crc << 1) ^ 0x1021u : (uint16_t)(crc << 1);
+    }
+
+    return crc;
+}
+
+/* crc16 of each of the four dat lines, computed on all four at once with the bits of each
+ line interleaved in the same order in which they appear on the bus */
+static inline uint64_t sdio_crc16_4bit(const unsigned char * data, const size_t words) {
+    uint64_t crc = 0;
+    if (!data) return crc;
+
+    for (size_t iword = 0; iword < words; iword++) {
+        uint32_t word;
+        __builtin_memcpy(&word, data + 4 * iword, 4);
+
+        /* this is the usual bytewise crc16 update, with each bit spread out by four */
+        uint32_t x = (crc >> 32) ^ __builtin_bswap32(word);
+        x ^= x >> 16;
+        crc = (crc << 32) ^ ((uint64_t)x << 48) ^ ((uint64_t)x << 20) ^ x;
+    }
+
+    return crc;
+}
+
+/* the two words given to the cmd state machine for one command: 16 idle bits, then the 48
+ bit frame of start bit, transmission bit, index, argument, crc7, and end bit */
+static inline void sdio_command_frame(const uint8_t cmd, const uint32_t arg, uint32_t frame[2]) {
+    unsigned char msg[6] = { cmd | 0x40, arg >> 24, arg >> 16, arg >> 8, arg, 0x01 };
+    msg[5] |= crc7_left_shifted(msg, 5);
+
+    frame[0] = 0xFFFF0000U | msg[0] << 8 | msg[1];
+    frame[1] = (uint32_t)msg[2] << 24 | msg[3] << 16 | msg[4] << 8 | msg[5];
+}
+
+/* given the 47 bits of a 48-bit response following the start bit, as one full word and then
+ 15 right-aligned bits, returns its 32 bit payload, or -1 if the index or crc are wrong */
+static inline int sdio_response_short(const uint8_t cmd, const uint32_t words[2], uint32_t * payload) {
+    const uint64_t bits = (uint64_t)words[0] << 15 | (words[1] & 0x7FFF);
+    *payload = bits >> 8;
+
+    /* r3 has neither a command index nor a crc */
+    if (41 == cmd) return 0;
+
+    const unsigned char msg[5] = { bits >> 40, bits >> 32, bits >> 24, bits >> 16, bits >> 8 };
+    return (bits >> 40 & 0x3F) != cmd || crc7_left_shifted(msg, 5) != (bits & 0xFE) ? -1 : 0;
+}
+
+/* given the 135 bits of a 136-bit response following the start bit, as four full words and
+ then 7 right-aligned bits, returns the 16 byte register it contains, or -1 if the crc is wrong */
+static inline int sdio_response_long(const uint32_t words_in[5], unsigned char reg[16]) {
+    uint32_t words[5] = { words_in[0], words_in[1], words_in[2], words_in[3], words_in[4] << 25 };
+
+    /* transmission bit and six reserved bits, and then the register */
+    for (size_t ibyte = 0; ibyte < 16; ibyte++) {
+        const size_t ibit = 7 + 8 * ibyte, iword = ibit / 32;
+        const uint64_t window = (uint64_t)words[iword] << 32 | (iword < 4 ? words[iword + 1] : 0);
+        reg[ibyte] = window >> (56 - ibit % 32);
+    }
+
+    return crc7_left_shifted(reg, 15) == (reg[15] & 0xFE) ? 0 : -1;
+}
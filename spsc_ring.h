@@ -0,0 +1,39 @@
+#pragma once
+
+/* indices of a single producer single consumer ring, whose slots live in an array owned by
+ the caller. each index is only ever written by one side, and the release store of it is what
+ makes the slot it covers visible to the other side. the depth must be a power of two, so that
+ the slot an index refers to stays the same when it wraps around. this touches no hardware,
+ and so is kept here where it can also be checked on a host */
+#include <stddef.h>
+
+struct spsc_ring {
+    size_t submitted, taken;
+};
+
+/* producer side: whether there is no free slot, which slot to fill next, and then publishing it */
+static inline int spsc_ring_full(const struct spsc_ring * ring, const size_t depth) {
+    return ring->submitted - __atomic_load_n(&ring->taken, __ATOMIC_ACQUIRE) >= depth;
+}
+
+static inline size_t spsc_ring_head(const struct spsc_ring * ring, const size_t depth) {
+    return ring->submitted % depth;
+}
+
+static inline void spsc_ring_publish(struct spsc_ring * ring) {
+    __atomic_store_n(&ring->submitted, ring->submitted + 1, __ATOMIC_RELEASE);
+}
+
+/* consumer side: whether there is nothing to take, which slot to take next, and then giving
+ it back to the producer once it is no longer needed */
+static inline int spsc_ring_empty(const struct spsc_ring * ring) {
+    return __atomic_load_n(&ring->submitted, __ATOMIC_ACQUIRE) == ring->taken;
+}
+
+static inline size_t spsc_ring_tail(const struct spsc_ring * ring, const size_t depth) {
+    return ring->taken % depth;
+}
+
+static inline void spsc_ring_release(struct spsc_ring * ring) {
+    __atomic_store_n(&ring->taken, ring->taken + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+/* just enough of the fatfs disk interface for diskio.c to build on a host */
+typedef BYTE DSTATUS;
+
+typedef enum { RES_OK = 0, RES_ERROR, RES_WRPRT, RES_NOTRDY, RES_PARERR } DRESULT;
+
+DSTATUS disk_initialize(BYTE pdrv);
+DSTATUS disk_status(BYTE pdrv);
+DRESULT disk_read(BYTE pdrv, BYTE * buff, LBA_t sector, UINT count);
+DRESULT disk_write(BYTE pdrv, const BYTE * buff, LBA_t sector, UINT count);
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void * buff);
+
+#define STA_NOINIT 0x01
+
+#define CTRL_SYNC 0
+#define GET_SECTOR_COUNT 1
+#define GET_SECTOR_SIZE 2
+#define GET_BLOCK_SIZE 3
+#define CTRL_TRIM 4
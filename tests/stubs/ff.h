@@ -0,0 +1,32 @@
+#pragma once
+
+/* just enough of fatfs for diskio.c to build on a host, with the same names and the same
+ configuration as the real thing */
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ffconf.h"
+
+typedef unsigned int UINT;
+typedef unsigned char BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint64_t QWORD;
+
+#if FF_LBA64
+typedef QWORD LBA_t;
+#else
+typedef DWORD LBA_t;
+#endif
+
+#define FS_FAT12 1
+#define FS_FAT16 2
+#define FS_FAT32 3
+#define FS_EXFAT 4
+
+typedef struct {
+    BYTE fs_type, n_fats;
+    WORD csize;
+    DWORD n_fatent, fsize;
+    LBA_t fatbase, dirbase, database, bitbase;
+} FATFS;
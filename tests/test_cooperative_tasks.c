@@ -0,0 +1,153 @@
+/* runs cooperative_tasks.c on its ucontext backend, and checks the order in which tasks run,
+ that each has its own identity and stack, that a lock held across a yield keeps others out,
+ and that slots freed by task_exit() or by returning can be used again */
+#include "cooperative_tasks.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+#define STACK_SIZE 65536
+static unsigned char stacks[TASKS_MAX][STACK_SIZE];
+
+/* what each task did, in the order they did it */
+static char trace[256];
+static size_t trace_length = 0;
+
+static void trace_add(const char c) {
+    if (trace_length + 1 < sizeof(trace)) trace[trace_length++] = c;
+}
+
+static void trace_reset(void) {
+    trace_length = 0;
+    memset(trace, 0, sizeof(trace));
+}
+
+struct worker {
+    char name;
+    unsigned passes;
+    unsigned char exit_early, done;
+    void * self;
+};
+
+static void worker(void * arg) {
+    struct worker * w = arg;
+    w->self = current_task();
+
+    for (unsigned ipass = 0; ipass < w->passes; ipass++) {
+        trace_add(w->name);
+
+        /* a local that must survive every other task running in between */
+        volatile unsigned check = ipass * 1000 + w->name;
+        yield();
+        CHECK(ipass * 1000 + w->name == check);
+        CHECK(w->self == current_task());
+
+        if (w->exit_early && 1 == ipass) {
+            w->done = 1;
+            task_exit();
+        }
+    }
+
+    w->done = 1;
+}
+
+static void test_round_robin(void) {
+    trace_reset();
+    struct worker a = { .name = 'a', .passes = 3 }, b = { .name = 'b', .passes = 3 };
+    void * task_a = task_create(worker, &a, stacks[1], STACK_SIZE);
+    void * task_b = task_create(worker, &b, stacks[2], STACK_SIZE);
+    CHECK(task_a && task_b && task_a != task_b);
+
+    /* nothing runs until the creator yields */
+    CHECK(0 == trace_length);
+
+    while (!a.done || !b.done) {
+        trace_add('m');
+        yield();
+    }
+
+    /* every task gets one turn per pass, in slot order, and finished tasks drop out */
+    CHECK(!strcmp("mabmabmabm", trace));
+    CHECK(task_a == a.self && task_b == b.self);
+    CHECK(current_task() != a.self && current_task() != b.self);
+}
+
+static void test_exit_and_reuse(void) {
+    trace_reset();
+    struct worker a = { .name = 'a', .passes = 5, .exit_early = 1 }, b = { .name = 'b', .passes = 1 };
+    CHECK(task_create(worker, &a, stacks[1], STACK_SIZE));
+    CHECK(task_create(worker, &b, stacks[2], STACK_SIZE));
+
+    while (!a.done || !b.done) yield();
+
+    /* a stopped partway through its passes when it called task_exit() */
+    CHECK(!strcmp("aba", trace));
+
+    /* every slot but the one main() is in is free again, and no more than that */
+    struct worker fill[TASKS_MAX];
+    for (size_t itask = 1; itask < TASKS_MAX; itask++) {
+        fill[itask] = (struct worker) { .name = 'x', .passes = 1 };
+        CHECK(task_create(worker, fill + itask, stacks[itask], STACK_SIZE));
+    }
+    struct worker extra = { .name = 'y', .passes = 1 };
+    CHECK(!task_create(worker, &extra, stacks[0], STACK_SIZE));
+
+    for (size_t itask = 1; itask < TASKS_MAX; itask++)
+        while (!fill[itask].done) yield();
+}
+
+/* the same sort of lock as card_lock() */
+static volatile unsigned char locked = 0;
+static unsigned inside = 0, inside_max = 0, entries = 0;
+
+static void locker(void * arg) {
+    unsigned char * done = arg;
+
+    for (size_t ipass = 0; ipass < 10; ipass++) {
+        while (locked) yield();
+        locked = 1;
+
+        if (++inside > inside_max) inside_max = inside;
+        entries++;
+        yield();
+        yield();
+        inside--;
+
+        locked = 0;
+        yield();
+    }
+
+    *done = 1;
+}
+
+static void test_lock(void) {
+    unsigned char done[TASKS_MAX] = { 0 };
+    for (size_t itask = 1; itask < TASKS_MAX; itask++)
+        CHECK(task_create(locker, done + itask, stacks[itask], STACK_SIZE));
+
+    for (size_t itask = 1; itask < TASKS_MAX; itask++)
+        while (!done[itask]) yield();
+
+    CHECK(1 == inside_max);
+    CHECK(10 * (TASKS_MAX - 1) == entries);
+}
+
+int main(void) {
+    const size_t switches_before = task_switches;
+
+    test_round_robin();
+    test_exit_and_reuse();
+    test_lock();
+
+    CHECK(task_switches > switches_before);
+    CHECK(task_passes > 0);
+
+    if (failures) fprintf(stderr, "%zu checks failed\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
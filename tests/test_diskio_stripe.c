@@ -0,0 +1,247 @@
+/* runs diskio.c, built with two card slots, on top of a fake driver backed by two image
+ files of different sizes, and checks where each sector of the volume lands, how large the
+ volume is, and that the rate controller of one card leaves the other alone */
+#include "ff.h"
+#include "diskio.h"
+#include "rp2350_sdcard.h"
+#include "hardware/timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Static_assert(2 == SDCARD_SLOTS, "this test needs diskio.c built with two card slots");
+
+/* must match diskio.c */
+#define STRIPE_SECTORS 128
+
+static size_t failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+static timer_hw_t timer;
+timer_hw_t * timer_hw = &timer;
+
+unsigned long microseconds_in_wait = 0;
+struct sd_card_info sd_card_info;
+
+/* the fake driver, which keeps the same per-slot state that the real one does */
+static const unsigned long long image_blocks[SDCARD_SLOTS] = { 1000, 700 };
+static FILE * images[SDCARD_SLOTS];
+static struct sd_card_info slot_infos[SDCARD_SLOTS];
+static unsigned slot_reductions[SDCARD_SLOTS];
+static unsigned slot = 0;
+
+static unsigned long long next_block;
+static unsigned long blocks_done, blocks_lost;
+
+/* how many of the next reads from each card fail halfway through, and how many of the next
+ writes fail, with the card saying it also lost a couple of earlier blocks */
+static unsigned reads_to_fail[SDCARD_SLOTS], writes_to_fail[SDCARD_SLOTS];
+
+int spi_sd_select(const unsigned new_slot) {
+    if (new_slot >= SDCARD_SLOTS) return -1;
+    slot_infos[slot] = sd_card_info;
+    sd_card_info = slot_infos[new_slot];
+    slot = new_slot;
+    return 0;
+}
+
+int spi_sd_init(const unsigned baud_rate_reduction) {
+    sd_card_info = (struct sd_card_info) { .blocks = image_blocks[slot], .high_capacity = 1 };
+    slot_reductions[slot] = baud_rate_reduction;
+    return 0;
+}
+
+unsigned spi_sd_reduce_baud_rate(const unsigned reduction) {
+    slot_reductions[slot] = reduction;
+    return 25000000U / (1U + reduction);
+}
+
+static int image_seek(const unsigned long long block, const unsigned long blocks) {
+    if (block + blocks > image_blocks[slot]) {
+        fprintf(stderr, "blocks %llu to %llu are past the end of card %u\n", block, block + blocks - 1, slot);
+        return -1;
+    }
+    return fseek(images[slot], 512 * block, SEEK_SET);
+}
+
+int spi_sd_read_blocks_start(const unsigned long long block_address) {
+    next_block = block_address;
+    return 0;
+}
+
+int spi_sd_read_some_blocks(void * buf, const unsigned long blocks) {
+    unsigned long blocks_ok = blocks;
+    if (reads_to_fail[slot]) {
+        reads_to_fail[slot]--;
+        blocks_ok = blocks / 2;
+    }
+
+    if (-1 == image_seek(next_block, blocks) || fread(buf, 512, blocks_ok, images[slot]) != blocks_ok) return -1;
+
+    next_block += blocks_ok;
+    blocks_done = blocks_ok;
+    return blocks_ok == blocks ? 0 : -1;
+}
+
+void spi_sd_read_blocks_end(void) { }
+
+int spi_sd_write_pre_erase(const unsigned long blocks) {
+    (void)blocks;
+    return 0;
+}
+
+int spi_sd_write_blocks_start(const unsigned long long block_address) {
+    next_block = block_address;
+    return 0;
+}
+
+int spi_sd_write_some_blocks(const void * buf, const unsigned long blocks) {
+    static const unsigned char zeros[512];
+    blocks_lost = 0;
+    if (writes_to_fail[slot]) {
+        writes_to_fail[slot]--;
+        blocks_done = 0;
+        blocks_lost = 2;
+        return -1;
+    }
+
+    if (-1 == image_seek(next_block, blocks)) return -1;
+
+    for (unsigned long iblock = 0; iblock < blocks; iblock++)
+        if (fwrite(buf ? (const unsigned char *)buf + 512 * iblock : zeros, 512, 1, images[slot]) != 1) return -1;
+
+    next_block += blocks;
+    blocks_done = blocks;
+    return 0;
+}
+
+void spi_sd_write_blocks_end(void) { }
+
+unsigned long spi_sd_blocks_done(void) { return blocks_done; }
+unsigned long spi_sd_blocks_lost(void) { return blocks_lost; }
+int spi_sd_recover(void) { return 0; }
+int spi_sd_wait_ready(void) { return 0; }
+int spi_sd_erase_blocks(unsigned long long first, unsigned long long last) { (void)first; (void)last; return -1; }
+int spi_sd_session_held(void) { return 0; }
+unsigned long spi_sd_session_idle_us(void) { return 0; }
+void spi_sd_session_release(void) { }
+void sd_startup_mark(enum sd_startup_stage stage) { (void)stage; }
+
+/* every sector of the volume starts with its own sector number, followed by bytes that
+ also depend on it */
+static void sector_fill(unsigned char * sector, const uint32_t lba) {
+    memcpy(sector, &lba, 4);
+    for (size_t ibyte = 4; ibyte < 512; ibyte++) sector[ibyte] = lba * 7 + ibyte;
+}
+
+static int sector_is(const unsigned char * sector, const uint32_t lba) {
+    unsigned char expected[512];
+    sector_fill(expected, lba);
+    return !memcmp(sector, expected, 512);
+}
+
+static unsigned char buf[512 * 512];
+
+int main(void) {
+    for (unsigned card = 0; card < SDCARD_SLOTS; card++) {
+        images[card] = tmpfile();
+        if (!images[card] || fseek(images[card], 512 * image_blocks[card] - 1, SEEK_SET) || EOF == fputc(0, images[card])) {
+            fprintf(stderr, "could not create image files\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    CHECK(0 == disk_initialize(0));
+
+    /* whole stripes, limited by the smaller card */
+    LBA_t sectors = 0;
+    CHECK(RES_OK == disk_ioctl(0, GET_SECTOR_COUNT, &sectors));
+    CHECK(image_blocks[1] / STRIPE_SECTORS * STRIPE_SECTORS * SDCARD_SLOTS == sectors);
+
+    DWORD block_size = 0;
+    CHECK(RES_OK == disk_ioctl(0, GET_BLOCK_SIZE, &block_size));
+    CHECK(STRIPE_SECTORS * SDCARD_SLOTS == block_size);
+
+    /* write the whole volume in pieces that start and end on either side of stripe boundaries */
+    static const UINT write_counts[] = { 1, 3, 124, 128, 129, 2, 255, 256, 300, 7 };
+    for (LBA_t sector = 0, ipiece = 0; sector < sectors; ipiece++) {
+        UINT count = write_counts[ipiece % (sizeof(write_counts) / sizeof(write_counts[0]))];
+        if (count > sectors - sector) count = sectors - sector;
+
+        for (UINT isector = 0; isector < count; isector++) sector_fill(buf + 512 * isector, sector + isector);
+        CHECK(RES_OK == disk_write(0, buf, sector, count));
+        sector += count;
+    }
+    CHECK(RES_OK == disk_ioctl(0, CTRL_SYNC, NULL));
+
+    /* each stripe of the volume is on alternating cards, and nothing is past the end of it */
+    for (unsigned card = 0; card < SDCARD_SLOTS; card++) {
+        CHECK(0 == fseek(images[card], 0, SEEK_SET));
+        for (unsigned long long block = 0; block < image_blocks[card]; block++) {
+            unsigned char sector[512];
+            CHECK(1 == fread(sector, 512, 1, images[card]));
+
+            const unsigned long long stripe = block / STRIPE_SECTORS * SDCARD_SLOTS + card;
+            const uint32_t lba = stripe * STRIPE_SECTORS + block % STRIPE_SECTORS;
+            if (lba < sectors) {
+                if (!sector_is(sector, lba)) {
+                    fprintf(stderr, "card %u block %llu does not hold volume sector %u\n", card, block, (unsigned)lba);
+                    failures++;
+                }
+            } else {
+                static const unsigned char zeros[512];
+                CHECK(!memcmp(sector, zeros, 512));
+            }
+        }
+    }
+
+    /* and reading it back in other pieces gets the same thing */
+    static const UINT read_counts[] = { 5, 250, 1, 128, 64, 131, 2, 400 };
+    for (LBA_t sector = 0, ipiece = 0; sector < sectors; ipiece++) {
+        UINT count = read_counts[ipiece % (sizeof(read_counts) / sizeof(read_counts[0]))];
+        if (count > sectors - sector) count = sectors - sector;
+
+        CHECK(RES_OK == disk_read(0, buf, sector, count));
+        for (UINT isector = 0; isector < count; isector++)
+            if (!sector_is(buf + 512 * isector, sector + isector)) {
+                fprintf(stderr, "volume sector %u read back wrong\n", (unsigned)(sector + isector));
+                failures++;
+            }
+        sector += count;
+    }
+
+    /* an error on the second card, partway through a read that spans both, slows only that
+     card down, and the read still succeeds */
+    CHECK(0 == slot_reductions[0] && 0 == slot_reductions[1]);
+    reads_to_fail[1] = 1;
+    CHECK(RES_OK == disk_read(0, buf, 100, 200));
+    for (UINT isector = 0; isector < 200; isector++) CHECK(sector_is(buf + 512 * isector, 100 + isector));
+    CHECK(0 == slot_reductions[0]);
+    CHECK(1 == slot_reductions[1]);
+
+    /* clean transfers on the first card do not count toward speeding up the second */
+    for (size_t iread = 0; iread < 1000; iread++)
+        CHECK(RES_OK == disk_read(0, buf, 0, 4));
+    CHECK(0 == slot_reductions[0]);
+    CHECK(1 == slot_reductions[1]);
+
+    /* but enough of them on the second card do */
+    for (size_t iread = 0; iread < 1000; iread++)
+        CHECK(RES_OK == disk_read(0, buf, STRIPE_SECTORS, 4));
+    CHECK(0 == slot_reductions[0]);
+    CHECK(0 == slot_reductions[1]);
+
+    /* a write that fails, and takes earlier blocks of the same multi-block write with it, is
+     itself retried, but the loss of the others is reported by the next sync, and only once */
+    writes_to_fail[0] = 1;
+    for (UINT isector = 0; isector < 4; isector++) sector_fill(buf + 512 * isector, isector);
+    CHECK(RES_OK == disk_write(0, buf, 0, 4));
+    CHECK(RES_ERROR == disk_ioctl(0, CTRL_SYNC, NULL));
+    CHECK(RES_OK == disk_ioctl(0, CTRL_SYNC, NULL));
+
+    if (failures) fprintf(stderr, "%zu checks failed\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,224 @@
+/* checks the crcs and bit packing in sd_protocol.h against straightforward bit-serial
+ versions written directly from the simplified physical spec */
+#include "sd_protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static size_t failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+/* a stream of bits, msb first, as they appear on one line of the bus */
+struct bits {
+    unsigned char bit[1024];
+    size_t count;
+};
+
+static void bits_push(struct bits * bits, const uint64_t value, const unsigned width) {
+    for (unsigned ibit = width; ibit--; )
+        bits->bit[bits->count++] = value >> ibit & 1U;
+}
+
+static unsigned crc7_serial(const struct bits * bits, const size_t first, const size_t count) {
+    unsigned crc = 0;
+    for (size_t ibit = first; ibit < first + count; ibit++) {
+        const unsigned feedback = (crc >> 6 & 1U) ^ bits->bit[ibit];
+        crc = (crc << 1 & 0x7F) ^ (feedback ? 0x09 : 0);
+    }
+    return crc;
+}
+
+static unsigned crc16_serial(const struct bits * bits) {
+    unsigned crc = 0;
+    for (size_t ibit = 0; ibit < bits->count; ibit++) {
+        const unsigned feedback = (crc >> 15 & 1U) ^ bits->bit[ibit];
+        crc = (crc << 1 & 0xFFFF) ^ (feedback ? 0x1021 : 0);
+    }
+    return crc;
+}
+
+/* what the pio program pushes after the start bit of a response: full words, msb first, and
+ then whatever is left over, right-aligned */
+static void bits_to_words(const struct bits * bits, const size_t first, uint32_t * words) {
+    size_t iword = 0;
+    uint32_t word = 0;
+    unsigned filled = 0;
+    for (size_t ibit = first; ibit < bits->count; ibit++) {
+        word = word << 1 | bits->bit[ibit];
+        if (32 == ++filled) {
+            words[iword++] = word;
+            word = 0;
+            filled = 0;
+        }
+    }
+    if (filled) words[iword] = word;
+}
+
+static uint32_t next_random(uint32_t * state) {
+    /* xorshift32, so that the test is repeatable */
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void test_crc7(void) {
+    /* well known values from the spec and from every sd card driver ever written */
+    CHECK(0x94 == crc7_left_shifted((const unsigned char[]) { 0x40, 0, 0, 0, 0 }, 5));
+    CHECK(0x86 == crc7_left_shifted((const unsigned char[]) { 0x48, 0, 0, 0x01, 0xAA }, 5));
+    CHECK(0x60 == crc7_left_shifted((const unsigned char[]) { 0x4C, 0, 0, 0, 0 }, 5));
+}
+
+static void test_crc16(void) {
+    /* 512 bytes of 0xFF, from the spec */
+    unsigned char block[512];
+    for (size_t ibyte = 0; ibyte < sizeof(block); ibyte++) block[ibyte] = 0xFF;
+    CHECK(0x7FA1 == crc16(block, sizeof(block)));
+}
+
+static void test_crc16_4bit(void) {
+    uint32_t state = 12345;
+
+    for (size_t itrial = 0; itrial < 64; itrial++) {
+        const size_t words = itrial < 32 ? 128 : 1 + itrial % 16;
+        unsigned char data[512];
+        for (size_t ibyte = 0; ibyte < 4 * words; ibyte++)
+            data[ibyte] = itrial < 2 ? (itrial ? 0xFF : 0x00) : next_random(&state);
+
+        /* split each byte into two nibbles, high first, and each nibble across the lines,
+         with dat3 carrying the most significant bit */
+        struct bits lines[4] = { 0 };
+        for (size_t ibyte = 0; ibyte < 4 * words; ibyte++)
+            for (unsigned inibble = 0; inibble < 2; inibble++) {
+                const unsigned nibble = inibble ? data[ibyte] & 0xF : data[ibyte] >> 4;
+                for (unsigned iline = 0; iline < 4; iline++)
+                    bits_push(lines + iline, nibble >> iline & 1U, 1);
+            }
+
+        /* the crc of each line is sent msb first on that line, as 16 more nibbles */
+        uint64_t expected = 0;
+        const unsigned crcs[4] = { crc16_serial(lines + 0), crc16_serial(lines + 1),
+                                   crc16_serial(lines + 2), crc16_serial(lines + 3) };
+        for (unsigned ibit = 16; ibit--; )
+            for (unsigned iline = 4; iline--; )
+                expected = expected << 1 | (crcs[iline] >> ibit & 1U);
+
+        CHECK(expected == sdio_crc16_4bit(data, words));
+    }
+
+    CHECK(0 == sdio_crc16_4bit(NULL, 128));
+}
+
+static void test_command_frame(void) {
+    static const struct { uint8_t cmd; uint32_t arg; } commands[] = {
+        { 0, 0 }, { 8, 0x1AA }, { 55, 0 }, { 41, 0x40FF8000 }, { 17, 0x12345678 }, { 63, 0xFFFFFFFF },
+    };
+
+    for (size_t icommand = 0; icommand < sizeof(commands) / sizeof(commands[0]); icommand++) {
+        struct bits bits = { 0 };
+        bits_push(&bits, 0xFFFF, 16);
+        bits_push(&bits, 0, 1);
+        bits_push(&bits, 1, 1);
+        bits_push(&bits, commands[icommand].cmd, 6);
+        bits_push(&bits, commands[icommand].arg, 32);
+        bits_push(&bits, crc7_serial(&bits, 16, 40), 7);
+        bits_push(&bits, 1, 1);
+
+        uint32_t expected[2], frame[2];
+        bits_to_words(&bits, 0, expected);
+        sdio_command_frame(commands[icommand].cmd, commands[icommand].arg, frame);
+
+        CHECK(expected[0] == frame[0]);
+        CHECK(expected[1] == frame[1]);
+    }
+}
+
+static void test_response_short(void) {
+    uint32_t state = 777;
+
+    for (size_t itrial = 0; itrial < 256; itrial++) {
+        const uint8_t cmd = next_random(&state) % 64;
+        const uint32_t status = next_random(&state);
+
+        struct bits bits = { 0 };
+        bits_push(&bits, 0, 1);
+        bits_push(&bits, 0, 1);
+        bits_push(&bits, cmd, 6);
+        bits_push(&bits, status, 32);
+        bits_push(&bits, crc7_serial(&bits, 0, 40), 7);
+        bits_push(&bits, 1, 1);
+
+        uint32_t words[2], payload = 0;
+        bits_to_words(&bits, 1, words);
+        CHECK(0 == sdio_response_short(cmd, words, &payload));
+        CHECK(status == payload);
+
+        /* any single flipped bit in the index, payload or crc must be caught */
+        const unsigned flip = next_random(&state) % 45;
+        bits.bit[2 + flip] ^= 1;
+        bits_to_words(&bits, 1, words);
+        CHECK(-1 == sdio_response_short(41 == cmd ? 40 : cmd, words, &payload));
+
+        /* and so must the response to a different command */
+        bits.bit[2 + flip] ^= 1;
+        bits_to_words(&bits, 1, words);
+        CHECK(-1 == sdio_response_short((cmd + 1) % 64 == 41 ? (cmd + 2) % 64 : (cmd + 1) % 64, words, &payload));
+    }
+
+    /* r3, the ocr, has ones where the index and crc would be */
+    struct bits bits = { 0 };
+    bits_push(&bits, 0, 1);
+    bits_push(&bits, 0, 1);
+    bits_push(&bits, 0x3F, 6);
+    bits_push(&bits, 0xC0FF8000, 32);
+    bits_push(&bits, 0x7F, 7);
+    bits_push(&bits, 1, 1);
+
+    uint32_t words[2], payload = 0;
+    bits_to_words(&bits, 1, words);
+    CHECK(0 == sdio_response_short(41, words, &payload));
+    CHECK(0xC0FF8000 == payload);
+}
+
+static void test_response_long(void) {
+    uint32_t state = 4242;
+
+    for (size_t itrial = 0; itrial < 256; itrial++) {
+        unsigned char expected[16];
+        for (size_t ibyte = 0; ibyte < 15; ibyte++) expected[ibyte] = next_random(&state);
+
+        struct bits bits = { 0 };
+        bits_push(&bits, 0, 1);
+        bits_push(&bits, 0, 1);
+        bits_push(&bits, 0x3F, 6);
+        for (size_t ibyte = 0; ibyte < 15; ibyte++) bits_push(&bits, expected[ibyte], 8);
+        const unsigned crc = crc7_serial(&bits, 8, 120);
+        bits_push(&bits, crc, 7);
+        bits_push(&bits, 1, 1);
+        expected[15] = crc << 1 | 1;
+
+        uint32_t words[5];
+        unsigned char reg[16];
+        bits_to_words(&bits, 1, words);
+        CHECK(0 == sdio_response_long(words, reg));
+        for (size_t ibyte = 0; ibyte < 16; ibyte++) CHECK(expected[ibyte] == reg[ibyte]);
+
+        bits.bit[8 + next_random(&state) % 127] ^= 1;
+        bits_to_words(&bits, 1, words);
+        CHECK(-1 == sdio_response_long(words, reg));
+    }
+}
+
+int main(void) {
+    test_crc7();
+    test_crc16();
+    test_crc16_4bit();
+    test_command_frame();
+    test_response_short();
+    test_response_long();
+
+    if (failures) fprintf(stderr, "%zu checks failed\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,91 @@
+/* runs a producer and a consumer thread through spsc_ring.h as fast as they can, and checks
+ that every slot arrives exactly once, in order, and never half written */
+#include "spsc_ring.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEPTH 4
+#define ITEMS 2000000
+
+/* the two halves of each slot are written separately, so that a slot taken before the
+ producer has finished with it shows up as a mismatch */
+static struct slot {
+    uint64_t value, check;
+} slots[DEPTH];
+
+static struct spsc_ring ring;
+
+static size_t full_waits = 0, empty_waits = 0;
+
+static void * producer(void * arg) {
+    (void)arg;
+    for (uint64_t ivalue = 0; ivalue < ITEMS; ivalue++) {
+        while (spsc_ring_full(&ring, DEPTH)) {
+            full_waits++;
+            sched_yield();
+        }
+
+        struct slot * slot = slots + spsc_ring_head(&ring, DEPTH);
+        slot->value = ivalue;
+        slot->check = ~ivalue;
+        spsc_ring_publish(&ring);
+    }
+    return NULL;
+}
+
+static void * consumer(void * arg) {
+    size_t * failures = arg;
+    for (uint64_t ivalue = 0; ivalue < ITEMS; ivalue++) {
+        while (spsc_ring_empty(&ring)) {
+            empty_waits++;
+            sched_yield();
+        }
+
+        struct slot * slot = slots + spsc_ring_tail(&ring, DEPTH);
+        if (slot->value != ivalue || slot->check != ~ivalue) {
+            if (*failures < 10)
+                fprintf(stderr, "expected %llu, got %llu and ~%llu\n", (unsigned long long)ivalue,
+                        (unsigned long long)slot->value, (unsigned long long)~slot->check);
+            (*failures)++;
+        }
+
+        /* scribble on the slot before giving it back, which the producer must overwrite */
+        slot->value = slot->check = 0;
+        spsc_ring_release(&ring);
+    }
+    return NULL;
+}
+
+int main(void) {
+    size_t failures = 0;
+
+    /* an empty ring is not full, and a ring with depth items in it is */
+    if (!spsc_ring_empty(&ring) || spsc_ring_full(&ring, DEPTH)) failures++;
+    for (size_t ifill = 0; ifill < DEPTH; ifill++) spsc_ring_publish(&ring);
+    if (spsc_ring_empty(&ring) || !spsc_ring_full(&ring, DEPTH)) failures++;
+    for (size_t ifill = 0; ifill < DEPTH; ifill++) spsc_ring_release(&ring);
+    if (!spsc_ring_empty(&ring) || spsc_ring_full(&ring, DEPTH)) failures++;
+    if (failures) fprintf(stderr, "wrong full or empty state\n");
+
+    /* start partway through, so that the indices wrap around along the way */
+    ring.submitted = ring.taken = SIZE_MAX - ITEMS / 2;
+
+    pthread_t threads[2];
+    if (pthread_create(threads + 0, NULL, consumer, &failures) ||
+        pthread_create(threads + 1, NULL, producer, NULL)) {
+        fprintf(stderr, "could not start threads\n");
+        return EXIT_FAILURE;
+    }
+    pthread_join(threads[1], NULL);
+    pthread_join(threads[0], NULL);
+
+    if (!spsc_ring_empty(&ring)) failures++;
+
+    fprintf(stderr, "%d items, %zu waits for a free slot, %zu waits for a full one\n", ITEMS, full_waits, empty_waits);
+    if (failures) fprintf(stderr, "%zu checks failed\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}